@@ -0,0 +1,124 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+
+
+// which frame to give up when a full queue receives another one
+enum class ShedPolicy
+{
+    DropOldest,     // keep the freshest frames, for live streams
+    DropNewest      // keep the frames already waiting, for recordings
+};
+
+
+struct AdmissionStats
+{
+    long admitted;
+    long shed;
+    long degraded;      // frames handed out with a degrade level above 0
+    size_t maxDepth;
+};
+
+
+// AdmissionQueue is a bounded frame queue between one capture thread and
+// the thread running MatchHandler::MatchImage. Frames over capacity are
+// shed by policy, and every frame is handed out with a degrade level that
+// follows the backlog: frames still waiting behind it at 1/4, 1/2 and 3/4
+// of capacity raise it to 1, 2 and 3 at once, and it falls only after
+// holdFrames frames with a shorter backlog
+class AdmissionQueue
+{
+    std::deque<cv::Mat> frames;
+    size_t capacity;
+    ShedPolicy policy;
+    bool closed;
+    int level;
+    int framesBelow;
+    AdmissionStats stats;
+    std::mutex mutex;
+    std::condition_variable ready;
+    const int holdFrames = 15;
+
+public:
+    static const int MaxLevel = 3;
+
+    AdmissionQueue(size_t _capacity=8, ShedPolicy _policy=ShedPolicy::DropOldest)
+        : capacity(std::max<size_t>(_capacity, 1)), policy(_policy), closed(false), level(0), framesBelow(0),
+          stats({0, 0, 0, 0}) {}
+
+    // returns false if the frame itself was shed
+    bool Push(cv::Mat frame)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(frames.size() >= capacity)
+            {
+                stats.shed++;
+                if(policy == ShedPolicy::DropNewest)
+                    return false;
+                frames.pop_front();
+            }
+            frames.push_back(frame);
+            stats.admitted++;
+            stats.maxDepth = std::max(stats.maxDepth, frames.size());
+        }
+        ready.notify_one();
+        return true;
+    }
+
+    // wait for the next frame; false once closed and drained
+    bool Pop(cv::Mat& frame, int& degradeLevel)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return closed || !frames.empty(); });
+        if(frames.empty())
+            return false;
+
+        // backlog behind the frame handed out now
+        const size_t backlog = frames.size() - 1;
+        const int target = int(std::min<size_t>(MaxLevel, backlog * 4 / capacity));
+        if(target >= level)
+        {
+            level = target;
+            framesBelow = 0;
+        }
+        else if(++framesBelow >= holdFrames)
+        {
+            level--;
+            framesBelow = 0;
+        }
+
+        frame = frames.front();
+        frames.pop_front();
+        degradeLevel = level;
+        if(level > 0)
+            stats.degraded++;
+        return true;
+    }
+
+    // wake the consumer and refuse nothing more; queued frames are still handed out
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        ready.notify_all();
+    }
+
+    AdmissionStats Stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    void PrintStats()
+    {
+        const AdmissionStats s = Stats();
+        std::cout << "admitted " << s.admitted << ", shed " << s.shed << ", degraded " << s.degraded
+                  << ", max queue depth " << s.maxDepth << "/" << capacity << std::endl;
+    }
+};
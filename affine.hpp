@@ -0,0 +1,276 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdint>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include "executor.hpp"
+
+
+// one synthetic view of an image: zoom by scale, rotate by angle (degrees),
+// then compress the x axis by tilt (ASIFT-style camera tilt, 1 = no tilt)
+struct AffineView
+{
+    float scale;
+    float angle;
+    float tilt;
+};
+
+
+// AffineSimulator renders synthetic views of an image, detects features on
+// each of them in parallel and maps the keypoints back into the original
+// image frame. Features of all views are stacked into one descriptor matrix,
+// so a single matcher index covers every simulated viewpoint.
+class AffineSimulator
+{
+    std::vector<AffineView> views;
+    float dedupRadius;      // pixels in the original frame, <= 0 keeps duplicates
+
+public:
+    AffineSimulator() : dedupRadius(0) {}
+    AffineSimulator(const std::vector<AffineView> _views, float _dedupRadius=2.f)
+    {
+        views = _views;
+        dedupRadius = _dedupRadius;
+    }
+
+    // every combination of scales and numRotations evenly spaced angles
+    static AffineSimulator Pyramid(const std::vector<float> scales, int numRotations=1)
+    {
+        std::vector<AffineView> views;
+        for(float scale : scales)
+            for(int r=0; r<numRotations; r++)
+                views.push_back({scale, 360.f * r / numRotations, 1.f});
+        return AffineSimulator(views);
+    }
+
+    // ASIFT sampling: tilts sqrt(2)^k for k < numTilts,
+    // with longitudes spaced 72/tilt degrees apart over half a turn
+    static AffineSimulator Asift(int numTilts=5)
+    {
+        std::vector<AffineView> views = {{1.f, 0.f, 1.f}};
+        for(int k=1; k<numTilts; k++)
+        {
+            const float tilt = std::pow(std::sqrt(2.f), float(k));
+            const float step = 72.f / tilt;
+            for(float angle=0.f; angle<180.f; angle+=step)
+                views.push_back({1.f, angle, tilt});
+        }
+        return AffineSimulator(views);
+    }
+
+    bool Empty() const { return views.empty(); }
+    const std::vector<AffineView>& Views() const { return views; }
+
+    // render a view; affine maps original to view coordinates,
+    // mask marks view pixels that come from inside the original image
+    static cv::Mat Warp(const cv::Mat& image, const AffineView& view, cv::Mat& affine, cv::Mat& mask)
+    {
+        cv::Point2f center(image.cols * 0.5f, image.rows * 0.5f);
+        affine = cv::getRotationMatrix2D(center, view.angle, view.scale);
+
+        // shift so that the whole rotated image lands inside the output
+        std::vector<cv::Point2f> corners = {
+            {0.f, 0.f}, {float(image.cols), 0.f},
+            {float(image.cols), float(image.rows)}, {0.f, float(image.rows)}};
+        std::vector<cv::Point2f> warped;
+        cv::transform(corners, warped, affine);
+        cv::Rect box = cv::boundingRect(warped);
+        affine.at<double>(0,2) -= box.x;
+        affine.at<double>(1,2) -= box.y;
+
+        cv::Mat source = image;
+        if(view.scale < 1.f)
+        {
+            // anti-aliasing before shrinking
+            const double sigma = 0.8 * std::sqrt(1.0 / (view.scale * view.scale) - 1.0);
+            cv::GaussianBlur(image, source, cv::Size(), sigma);
+        }
+        cv::Mat result;
+        cv::warpAffine(source, result, affine, box.size(), cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+        cv::warpAffine(cv::Mat(image.size(), CV_8UC1, cv::Scalar(255)), mask, affine,
+                       box.size(), cv::INTER_NEAREST, cv::BORDER_CONSTANT);
+
+        if(view.tilt > 1.f)
+        {
+            // anti-aliasing along x only, then subsample x by the tilt
+            const double sigma = 0.8 * std::sqrt(view.tilt * view.tilt - 1.0);
+            const int ksize = 2 * int(std::ceil(3 * sigma)) + 1;
+            cv::GaussianBlur(result, result, cv::Size(ksize, 1), sigma, 0.01);
+            cv::Size tilted(std::max(1, int(result.cols / view.tilt)), result.rows);
+            cv::resize(result, result, tilted, 0, 0, cv::INTER_LINEAR);
+            cv::resize(mask, mask, tilted, 0, 0, cv::INTER_NEAREST);
+            for(int c=0; c<3; c++)
+                affine.at<double>(0,c) /= view.tilt;
+        }
+
+        // keep detections away from the black border introduced by the warp
+        cv::erode(mask, mask, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(5,5)));
+        return result;
+    }
+
+    // move keypoints detected on a view back into original image coordinates
+    static void MapBack(std::vector<cv::KeyPoint>& keypts, const cv::Mat& affine, const AffineView& view)
+    {
+        cv::Mat inverse;
+        cv::invertAffineTransform(affine, inverse);
+        const double* m = inverse.ptr<double>(0);
+        const float sizeScale = std::sqrt(view.tilt) / view.scale;
+        for(cv::KeyPoint& kp : keypts)
+        {
+            const float x = kp.pt.x, y = kp.pt.y;
+            kp.pt.x = float(m[0]*x + m[1]*y + m[2]);
+            kp.pt.y = float(m[3]*x + m[4]*y + m[5]);
+            kp.size *= sizeScale;
+            if(kp.angle >= 0)
+            {
+                // orientation follows the direction vector through the linear part
+                const double rad = kp.angle * CV_PI / 180.0;
+                const double dx = m[0]*std::cos(rad) + m[1]*std::sin(rad);
+                const double dy = m[3]*std::cos(rad) + m[4]*std::sin(rad);
+                double angle = std::atan2(dy, dx) * 180.0 / CV_PI;
+                kp.angle = float(angle < 0 ? angle + 360.0 : angle);
+            }
+        }
+    }
+
+    // detect and describe every view in parallel (one view at a time on
+    // PriorityExecutor's background lane), then stack keypoints and
+    // descriptors in view order and drop cross-view duplicates
+    void DetectAndCompute(cv::Ptr<cv::Feature2D> feature, const cv::Mat& image,
+                          std::vector<cv::KeyPoint>& keypts, cv::Mat& descriptors,
+                          float scale=1.f) const
+    {
+        std::vector<std::vector<cv::KeyPoint>> viewKeypts(views.size());
+        std::vector<cv::Mat> viewDescs(views.size());
+        auto describeView = [&](int v)
+        {
+            AffineView view = views[v];
+            view.scale *= scale;
+            cv::Mat affine, mask;
+            cv::Mat warped = Warp(image, view, affine, mask);
+            feature->detectAndCompute(warped, mask, viewKeypts[v], viewDescs[v]);
+            MapBack(viewKeypts[v], affine, view);
+        };
+        if(PriorityExecutor::OnBackgroundLane())
+        {
+            for(int v=0; v<int(views.size()); v++)
+            {
+                PriorityExecutor::Instance().Yield();
+                describeView(v);
+            }
+        }
+        else
+        {
+            cv::parallel_for_(cv::Range(0, int(views.size())), [&](const cv::Range& range)
+            {
+                for(int v=range.start; v<range.end; v++)
+                    describeView(v);
+            });
+        }
+
+        keypts.clear();
+        descriptors.release();
+        std::vector<int> viewIds;
+        for(size_t v=0; v<views.size(); v++)
+        {
+            if(viewKeypts[v].empty())
+                continue;
+            keypts.insert(keypts.end(), viewKeypts[v].begin(), viewKeypts[v].end());
+            descriptors.push_back(viewDescs[v]);
+            viewIds.insert(viewIds.end(), viewKeypts[v].size(), int(v));
+        }
+        if(dedupRadius > 0)
+            Deduplicate(keypts, descriptors, viewIds);
+    }
+
+private:
+    // the same corner is usually found in several neighbouring views;
+    // keep the strongest response among keypoints from different views that
+    // land within dedupRadius with a similar size
+    void Deduplicate(std::vector<cv::KeyPoint>& keypts, cv::Mat& descriptors,
+                     const std::vector<int>& viewIds) const
+    {
+        std::vector<int> order(keypts.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&keypts](int a, int b)
+        {
+            return keypts[a].response > keypts[b].response;
+        });
+
+        // spatial hash with cells of dedupRadius
+        auto cellKey = [](int cx, int cy) { return (int64_t(cx) << 32) ^ uint32_t(cy); };
+        std::unordered_map<int64_t, std::vector<int>> grid;
+        std::vector<char> keep(keypts.size(), 0);
+        const float r2 = dedupRadius * dedupRadius;
+        for(int idx : order)
+        {
+            const cv::KeyPoint& kp = keypts[idx];
+            const int cx = int(std::floor(kp.pt.x / dedupRadius));
+            const int cy = int(std::floor(kp.pt.y / dedupRadius));
+            bool duplicate = false;
+            for(int dy=-1; dy<=1 && !duplicate; dy++)
+                for(int dx=-1; dx<=1 && !duplicate; dx++)
+                {
+                    auto cell = grid.find(cellKey(cx+dx, cy+dy));
+                    if(cell == grid.end())
+                        continue;
+                    for(int other : cell->second)
+                    {
+                        const cv::KeyPoint& ko = keypts[other];
+                        const float ddx = kp.pt.x - ko.pt.x, ddy = kp.pt.y - ko.pt.y;
+                        const float ratio = kp.size / std::max(ko.size, 1e-3f);
+                        if(viewIds[other] != viewIds[idx] && ddx*ddx + ddy*ddy <= r2
+                           && ratio > 0.5f && ratio < 2.f)
+                        {
+                            duplicate = true;
+                            break;
+                        }
+                    }
+                }
+            if(!duplicate)
+            {
+                keep[idx] = 1;
+                grid[cellKey(cx, cy)].push_back(idx);
+            }
+        }
+
+        std::vector<cv::KeyPoint> keptKeypts;
+        cv::Mat keptDesc;
+        for(size_t i=0; i<keypts.size(); i++)
+            if(keep[i])
+            {
+                keptKeypts.push_back(keypts[i]);
+                keptDesc.push_back(descriptors.row(int(i)));
+            }
+        keypts.swap(keptKeypts);
+        descriptors = keptDesc;
+    }
+
+public:
+    // time one DetectAndCompute for 1, 2, 4 ... threads up to the CPU count
+    static void BenchmarkThreads(const AffineSimulator& simulator, cv::Ptr<cv::Feature2D> feature,
+                                 const cv::Mat& image)
+    {
+        const int oldThreads = cv::getNumThreads();
+        double base = 0;
+        for(int threads=1; threads<=cv::getNumberOfCPUs(); threads*=2)
+        {
+            cv::setNumThreads(threads);
+            std::vector<cv::KeyPoint> keypts;
+            cv::Mat descriptors;
+            const int64 start = cv::getTickCount();
+            simulator.DetectAndCompute(feature, image, keypts, descriptors);
+            const double ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+            if(threads == 1)
+                base = ms;
+            std::cout << "threads: " << threads << "  views: " << simulator.Views().size()
+                      << "  keypoints: " << keypts.size() << "  time: " << ms << " ms"
+                      << "  speedup: " << base / ms << std::endl;
+        }
+        cv::setNumThreads(oldThreads);
+    }
+};
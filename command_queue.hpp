@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+
+// Lock-free single-producer / single-consumer ring buffer.
+// One thread may call Push and one other thread may call Pop concurrently.
+template<typename T, size_t Capacity>
+class SpscQueue
+{
+    T buffer[Capacity];
+    std::atomic<size_t> head;   // next slot to read, owned by the consumer
+    std::atomic<size_t> tail;   // next slot to write, owned by the producer
+
+public:
+    SpscQueue() : head(0), tail(0) {}
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // false if the queue is full, the item is not stored
+    bool Push(const T& item)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        const size_t next = (t + 1) % Capacity;
+        if(next == head.load(std::memory_order_acquire))
+            return false;
+        buffer[t] = item;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // false if the queue is empty
+    bool Pop(T& item)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire))
+            return false;
+        item = buffer[h];
+        head.store((h + 1) % Capacity, std::memory_order_release);
+        return true;
+    }
+};
@@ -0,0 +1,113 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sys/stat.h>
+#include "feature.hpp"
+
+
+// ConfigWatcher lets a running MatchHandler be retuned through a control file.
+// The file lists the wanted detector/matcher pairs, one per line:
+//
+//     # feature matcher [parameter=value ...]
+//     orb  flann nfeatures=1000 fastThreshold=15
+//     sift bf    contrastThreshold=0.03
+//
+// Adding, removing or swapping lines changes the running set. The file is
+// polled on a background thread; a changed file is rebuilt there with
+// MatchHandler::Reconfigure and swapped in between two frames.
+class ConfigWatcher
+{
+    std::string path;
+    MatchHandler& handler;
+    std::atomic<bool> running;
+    std::thread thread;
+
+public:
+    ConfigWatcher(const std::string _path, MatchHandler& _handler)
+        : path(_path), handler(_handler), running(true)
+    {
+        thread = std::thread(&ConfigWatcher::Loop, this);
+    }
+
+    ~ConfigWatcher()
+    {
+        running = false;
+        thread.join();
+    }
+
+    // parse one "feature matcher [key=value ...]" line
+    static PairConfig ParseLine(const std::string& line)
+    {
+        std::istringstream tokens(line);
+        PairConfig config;
+        if(!(tokens >> config.feature >> config.matcher))
+            throw std::string("expected 'feature matcher [key=value ...]': ") + line;
+        std::string param;
+        while(tokens >> param)
+        {
+            const size_t eq = param.find('=');
+            if(eq == std::string::npos)
+                throw std::string("expected key=value: ") + param;
+            try
+            {
+                config.params[param.substr(0, eq)] = std::stod(param.substr(eq + 1));
+            }
+            catch(const std::exception&)
+            {
+                throw std::string("bad value: ") + param;
+            }
+        }
+        return config;
+    }
+
+    static std::vector<PairConfig> ParseFile(const std::string& path)
+    {
+        std::ifstream file(path);
+        std::vector<PairConfig> configs;
+        std::string line;
+        while(std::getline(file, line))
+        {
+            const size_t comment = line.find('#');
+            if(comment != std::string::npos)
+                line.erase(comment);
+            if(line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+            configs.push_back(ParseLine(line));
+        }
+        return configs;
+    }
+
+private:
+    void Loop()
+    {
+        struct timespec lastModified = {0, 0};
+        while(running)
+        {
+            struct stat info;
+            if(stat(path.c_str(), &info) == 0 &&
+               (info.st_mtim.tv_sec != lastModified.tv_sec || info.st_mtim.tv_nsec != lastModified.tv_nsec))
+            {
+                lastModified = info.st_mtim;
+                try
+                {
+                    if(handler.Reconfigure(ParseFile(path)))
+                        std::cout << "reloaded configuration from " << path << std::endl;
+                }
+                catch(const std::string& e)
+                {
+                    std::cerr << path << ": " << e << std::endl;
+                }
+                catch(const std::exception& e)
+                {
+                    std::cerr << path << ": " << e.what() << std::endl;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+    }
+};
@@ -0,0 +1,81 @@
+#pragma once
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <opencv2/opencv.hpp>
+#include "feature.hpp"
+
+
+// Display owns every HighGUI call on a dedicated thread: it draws and shows
+// the newest results handed over by the processing loop and turns key presses
+// into commands for MatchHandler, so neither cv::waitKey nor drawing stalls
+// frame processing
+class Display
+{
+    std::string window;
+    MatchHandler& handler;
+    std::mutex resultMutex;
+    std::vector<MatcherResultPtr> latest;
+    bool fresh;
+    ResultRenderer renderer;
+    std::atomic<bool> running;
+    std::thread thread;
+
+public:
+    Display(const std::string _window, MatchHandler& _handler)
+        : window(_window), handler(_handler), fresh(false), running(true)
+    {
+        thread = std::thread(&Display::Loop, this);
+    }
+
+    ~Display()
+    {
+        running = false;
+        thread.join();
+    }
+
+    // hand over the results of a frame; frames not yet shown are simply replaced
+    void Show(const std::vector<MatcherResultPtr>& results)
+    {
+        std::lock_guard<std::mutex> lock(resultMutex);
+        latest = results;
+        fresh = true;
+    }
+
+private:
+    void Loop()
+    {
+        while(running)
+        {
+            std::vector<MatcherResultPtr> results;
+            {
+                std::lock_guard<std::mutex> lock(resultMutex);
+                if(fresh)
+                {
+                    results.swap(latest);
+                    fresh = false;
+                }
+            }
+            if(!results.empty())
+            {
+                cv::Mat image = renderer.Draw(results);
+                if(!image.empty())
+                    cv::imshow(window, image);
+            }
+
+            int key = cv::waitKey(5);
+            if(key==int('f') || key==int('F') || key==int('r') || key==int('R'))
+                handler.PostCommand(HandlerCommand::ChangeReference);
+            else if(key==int('u') || key==int('U'))
+                handler.PostCommand(HandlerCommand::RatioUp);
+            else if(key==int('d') || key==int('D'))
+                handler.PostCommand(HandlerCommand::RatioDown);
+            else if(key==int('q') || key==int('Q'))
+            {
+                handler.PostCommand(HandlerCommand::Quit);
+                running = false;
+            }
+        }
+        cv::destroyAllWindows();
+    }
+};
@@ -0,0 +1,164 @@
+#pragma once
+#include <deque>
+#include <string>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <opencv2/opencv.hpp>
+
+
+// PriorityExecutor runs background work (reference enrollment, index
+// building) beside the live per-frame pipeline. Live work marks itself
+// with a LiveScope; background tasks run on their own few low-priority
+// threads, keep their work serial instead of fanning out on OpenCV's pool
+// (see OnBackgroundLane), and wait at every Yield() point while live work
+// is active, but never longer than maxDeferMs, so enrollment still makes
+// progress when frames arrive back to back.
+// OpenCV's internal loops inside one detector call may still use its pool;
+// steps between Yield() points are kept to one detector or one view
+class PriorityExecutor
+{
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskReady;
+    std::condition_variable liveIdle;
+    int liveActive;
+    bool stopping;
+    int maxDeferMs;
+
+public:
+    // marks live work for its lifetime
+    class LiveScope
+    {
+        PriorityExecutor& executor;
+    public:
+        LiveScope(PriorityExecutor& _executor) : executor(_executor)
+        {
+            std::lock_guard<std::mutex> lock(executor.mutex);
+            executor.liveActive++;
+        }
+        ~LiveScope()
+        {
+            {
+                std::lock_guard<std::mutex> lock(executor.mutex);
+                executor.liveActive--;
+            }
+            executor.liveIdle.notify_all();
+        }
+    };
+
+    // backgroundThreads <= 0 uses the cores OpenCV's live pool leaves over, at least one
+    PriorityExecutor(int backgroundThreads=0, int _maxDeferMs=100)
+        : liveActive(0), stopping(false), maxDeferMs(_maxDeferMs)
+    {
+        if(backgroundThreads <= 0)
+            backgroundThreads = std::max(1, int(std::thread::hardware_concurrency()) - cv::getNumThreads());
+        for(int i=0; i<backgroundThreads; i++)
+            workers.emplace_back(&PriorityExecutor::WorkerLoop, this);
+    }
+
+    ~PriorityExecutor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskReady.notify_all();
+        liveIdle.notify_all();
+        for(std::thread& worker : workers)
+            worker.join();
+    }
+
+    static PriorityExecutor& Instance()
+    {
+        static PriorityExecutor executor;
+        return executor;
+    }
+
+    // true on the executor's background threads; work there should run
+    // serially rather than through cv::parallel_for_, which would take
+    // OpenCV's pool away from the live pipeline
+    static bool& OnBackgroundLane()
+    {
+        static thread_local bool onLane = false;
+        return onLane;
+    }
+
+    int BackgroundThreads() const { return int(workers.size()); }
+
+    // queue a task on the background lane
+    void Submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(task);
+        }
+        taskReady.notify_one();
+    }
+
+    // run a task on the background lane and wait for it; runs inline if
+    // the caller already is on the lane. exceptions reach the caller
+    void RunOnLane(std::function<void()> task)
+    {
+        if(OnBackgroundLane())
+        {
+            task();
+            return;
+        }
+        std::shared_ptr<std::packaged_task<void()>> packaged = std::make_shared<std::packaged_task<void()>>(task);
+        std::future<void> done = packaged->get_future();
+        Submit([packaged] { (*packaged)(); });
+        done.get();
+    }
+
+    // let live work go first: block while any is active, at most maxDeferMs
+    void Yield()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        liveIdle.wait_for(lock, std::chrono::milliseconds(maxDeferMs),
+                          [this] { return stopping || liveActive == 0; });
+    }
+
+private:
+    void WorkerLoop()
+    {
+        OnBackgroundLane() = true;
+        // lower OS priority than the live pipeline's threads
+        setpriority(PRIO_PROCESS, pid_t(syscall(SYS_gettid)), 10);
+        while(true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                taskReady.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if(tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            Yield();
+            // a failing task must not take the lane down with it
+            try
+            {
+                task();
+            }
+            catch(const std::string& e)
+            {
+                std::cerr << "background task failed: " << e << std::endl;
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "background task failed: " << e.what() << std::endl;
+            }
+        }
+    }
+};
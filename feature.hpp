@@ -1,81 +1,408 @@
+#pragma once
 #include <vector>
 #include <cassert>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <numeric>
+#include <iterator>
+#include <map>
+#include <deque>
+#include <set>
+#include <memory>
+#include <unordered_map>
 #include <opencv2/opencv.hpp>
 #include <opencv2/xfeatures2d.hpp>
+#include <opencv2/flann/random.h>
+#include "affine.hpp"
+#include "command_queue.hpp"
+#include "result_pool.hpp"
+#include "preprocess.hpp"
+#include "sketch.hpp"
+#include "executor.hpp"
+#include "vlad.hpp"
+#include "tracks.hpp"
 
 typedef cv::Ptr<cv::Feature2D> FeaturePtr;
 typedef cv::Ptr<cv::DescriptorMatcher> MatcherPtr;
 
 
+// ExecutionPolicy decides how per-feature work is spread over threads.
+// In deterministic mode every stage uses fixed seeds and canonical orderings,
+// so results are bit-identical across runs and thread counts.
+struct ExecutionPolicy
+{
+    int numThreads;         // <= 0 keeps OpenCV's default thread count
+    bool deterministic;
+    unsigned int seed;
+
+    static ExecutionPolicy& Current()
+    {
+        static ExecutionPolicy policy = {0, false, 12345u};
+        return policy;
+    }
+
+    // reset the calling thread's random state before a stage runs
+    static void SeedThread()
+    {
+        if(Current().deterministic)
+            cv::setRNGSeed(int(Current().seed));
+    }
+};
+
+
+// optional numeric detector parameters by name, e.g. {"nfeatures", 1000}
+typedef std::map<std::string, double> DetectorParams;
+
+// reads DetectorParams with defaults and rejects keys nobody asked for
+class ParamReader
+{
+    const DetectorParams& params;
+    std::set<std::string> used;
+
+public:
+    ParamReader(const DetectorParams& _params) : params(_params) {}
+
+    double Get(const std::string key, double defaultValue)
+    {
+        used.insert(key);
+        auto it = params.find(key);
+        return it == params.end() ? defaultValue : it->second;
+    }
+
+    void CheckAllUsed() const
+    {
+        for(const auto& param : params)
+            if(!used.count(param.first))
+                throw std::string("unknown parameter: ") + param.first;
+    }
+};
+
+
+// ThresholdController is a closed loop on one detector threshold: it smooths
+// the keypoint count and nudges the threshold multiplicatively, within bounds,
+// until the count sits inside the target band, keeping per-frame matching
+// cost flat between textured and flat scenes
+class ThresholdController
+{
+    int minCount, maxCount;     // target band, maxCount <= 0 disables the loop
+    double threshold, minThreshold, maxThreshold;
+    double avgCount;            // counts seen at the current threshold only
+    int framesAtThreshold;
+    const double smoothing = 0.3;
+    const double gain = 0.5;    // exponent on the count error
+    const int holdFrames = 2;   // frames averaged after a step before the next one
+
+public:
+    ThresholdController() : minCount(0), maxCount(0), threshold(0), minThreshold(0), 
+                            maxThreshold(0), avgCount(-1), framesAtThreshold(0) {}
+
+    void Configure(int _minCount, int _maxCount, double start, double lower, double upper)
+    {
+        minCount = _minCount;
+        maxCount = _maxCount;
+        threshold = start;
+        minThreshold = lower;
+        maxThreshold = upper;
+        avgCount = -1;
+        framesAtThreshold = 0;
+    }
+
+    bool Enabled() const { return maxCount > 0; }
+    double Threshold() const { return threshold; }
+
+    // feed the keypoint count of a frame, true if the threshold changed
+    bool Update(size_t count)
+    {
+        if(!Enabled())
+            return false;
+        avgCount = avgCount < 0 ? double(count) : (1 - smoothing) * avgCount + smoothing * count;
+        if(++framesAtThreshold < holdFrames || (avgCount >= minCount && avgCount <= maxCount))
+            return false;
+
+        // higher thresholds give fewer keypoints; steps are limited to 2x
+        const double target = 0.5 * (minCount + maxCount);
+        const double step = std::pow(std::max(avgCount, 1.0) / target, gain);
+        const double next = std::max(minThreshold, std::min(maxThreshold, 
+                                     threshold * std::max(0.5, std::min(2.0, step))));
+        if(next == threshold)
+            return false;
+        // counts from the old threshold would keep pushing the same way
+        threshold = next;
+        avgCount = -1;
+        framesAtThreshold = 0;
+        return true;
+    }
+};
+
+
+// keypoints and descriptors of one image. Published results are immutable
+// and shared through DetectResultPtr, so a frame can still be drawn or
+// matched on one thread while the Detector already works on the next one
 struct DetectResult
 {
-    const std::string name;
+    std::string name;
     cv::Mat image;
-    const std::vector<cv::KeyPoint>& keypts;
+    std::vector<cv::KeyPoint> keypts;
     cv::Mat descriptors;
+    cv::Mat sketch;         // binary sketch of float descriptors, if requested
+
+    void Recycle()
+    {
+        image.release();
+        keypts.clear();
+        descriptors.release();
+        sketch.release();
+    }
 };
+typedef std::shared_ptr<const DetectResult> DetectResultPtr;
 
 // Detector holds keypoint detector, descriptor computer and their results
 class Detector
 {
     FeaturePtr feature;
     std::string name;
-    cv::Mat image;
-    std::vector<cv::KeyPoint> keypts;
-    cv::Mat descriptors;
+    DetectorParams params;
+    ResultPool<DetectResult> pool;
+    DetectResultPtr result;
+    ThresholdController controller;
+    int sketchBits;
 
 public:
     Detector(const std::string _name, FeaturePtr _feature)
     {
         name = _name;
         feature = _feature;
+        sketchBits = 0;
     }
     
-    static Detector Factory(const std::string name)
+    static Detector Factory(const std::string name, const DetectorParams& params=DetectorParams())
     {
+        ParamReader p(params);
         FeaturePtr desc;
         if(name=="sift")
-            return Detector(name, cv::SIFT::create());
+            desc = cv::SIFT::create(int(p.Get("nfeatures", 0)), int(p.Get("nOctaveLayers", 3)),
+                                    p.Get("contrastThreshold", 0.04), p.Get("edgeThreshold", 10),
+                                    p.Get("sigma", 1.6));
         else if(name=="surf")
-            return Detector(name, cv::xfeatures2d::SURF::create());
+            desc = cv::xfeatures2d::SURF::create(p.Get("hessianThreshold", 100), int(p.Get("nOctaves", 4)),
+                                                 int(p.Get("nOctaveLayers", 3)));
         else if(name == "orb")
-            return Detector(name, cv::ORB::create());
+            desc = cv::ORB::create(int(p.Get("nfeatures", 500)), float(p.Get("scaleFactor", 1.2)),
+                                   int(p.Get("nlevels", 8)), 31, 0, 2, cv::ORB::HARRIS_SCORE, 31,
+                                   int(p.Get("fastThreshold", 20)));
         else if(name == "kaze")
-            return Detector(name, cv::KAZE::create());
+            desc = cv::KAZE::create(false, false, float(p.Get("threshold", 0.001)));
         else if(name == "brisk")
-            return Detector(name, cv::BRISK::create());
+            desc = cv::BRISK::create(int(p.Get("thresh", 30)), int(p.Get("octaves", 3)));
         else
             throw std::string("error");
-            
+        p.CheckAllUsed();
+        Detector detector(name, desc);
+        detector.params = params;
+        return detector;
+    }
+
+    // the parameter that thins out keypoints for each feature type,
+    // with its default and a sane range
+    static bool ThresholdParam(const std::string name, std::string& key,
+                               double& defaultValue, double& lower, double& upper)
+    {
+        if(name == "sift")
+            key = "contrastThreshold", defaultValue = 0.04, lower = 0.004, upper = 0.2;
+        else if(name == "surf")
+            key = "hessianThreshold", defaultValue = 100, lower = 10, upper = 5000;
+        else if(name == "orb")
+            key = "fastThreshold", defaultValue = 20, lower = 3, upper = 80;
+        else if(name == "kaze")
+            key = "threshold", defaultValue = 0.001, lower = 1e-5, upper = 0.05;
+        else if(name == "brisk")
+            key = "thresh", defaultValue = 30, lower = 5, upper = 120;
+        else
+            return false;
+        return true;
+    }
+
+    // adapt the detection threshold so keypoint counts stay in [minCount, maxCount],
+    // maxCount <= 0 turns adaptation off
+    void SetTargetKeypoints(int minCount, int maxCount)
+    {
+        std::string key;
+        double value, lower, upper;
+        if(!ThresholdParam(name, key, value, lower, upper))
+            return;
+        auto given = params.find(key);
+        if(given != params.end())
+            value = given->second;
+        controller.Configure(minCount, maxCount, value, lower, upper);
     }
     
-    void DetectAndCompute(cv::Mat _image)
+    // rough relative cost of each feature type, cheapest first
+    static int CostRank(const std::string name)
+    {
+        static const std::vector<std::string> order = {"orb", "brisk", "surf", "kaze", "sift"};
+        auto it = std::find(order.begin(), order.end(), name);
+        return int(it - order.begin());
+    }
+
+    // a detector on the same Feature2D engine with its own result storage.
+    // OpenCV detectors keep no per-call state, so sharing one engine between
+    // reference and input (or between pairs) is safe even across threads
+    Detector Share() const
+    {
+        Detector detector(name, feature);
+        detector.params = params;
+        return detector;
+    }
+
+    // scale < 1 detects on a downscaled copy and maps keypoints back to
+    // the coordinates of _image, which is kept for drawing without a copy:
+    // the caller must not write into its pixels afterwards.
+    // a non-empty roi restricts detection to that part of _image
+    void DetectAndCompute(cv::Mat _image, float scale=1.f, cv::Rect roi=cv::Rect())
+    {
+        std::shared_ptr<DetectResult> next = pool.Acquire();
+        next->name = name;
+        next->image = _image;
+        std::vector<cv::KeyPoint>& keypts = next->keypts;
+        cv::Mat source = roi.empty() ? _image : _image(roi);
+        if(scale >= 1.f)
+            feature->detectAndCompute(source, cv::Mat(), keypts, next->descriptors);
+        else
+        {
+            cv::Mat small;
+            cv::resize(source, small, cv::Size(), scale, scale, cv::INTER_AREA);
+            feature->detectAndCompute(small, cv::Mat(), keypts, next->descriptors);
+            const float inv = 1.f / scale;
+            for(cv::KeyPoint& kp : keypts)
+            {
+                kp.pt.x = (kp.pt.x + 0.5f) * inv - 0.5f;
+                kp.pt.y = (kp.pt.y + 0.5f) * inv - 0.5f;
+                kp.size *= inv;
+            }
+        }
+        for(cv::KeyPoint& kp : keypts)
+            kp.pt += cv::Point2f(float(roi.x), float(roi.y));
+        if(ExecutionPolicy::Current().deterministic)
+            CanonicalOrder(keypts, next->descriptors);
+        Publish(next);
+    }
+
+    // detect on synthetic views of _image, keypoints stay in _image coordinates
+    void DetectAndComputeViews(cv::Mat _image, const AffineSimulator& simulator, float scale=1.f)
+    {
+        std::shared_ptr<DetectResult> next = pool.Acquire();
+        next->name = name;
+        next->image = _image;
+        simulator.DetectAndCompute(feature, _image, next->keypts, next->descriptors, scale);
+        if(ExecutionPolicy::Current().deterministic)
+            CanonicalOrder(next->keypts, next->descriptors);
+        Publish(next);
+    }
+
+    // also store a binary sketch of float descriptors with every result,
+    // for the two-stage "sketch" matcher; 0 turns it off
+    void EnableSketch(int bits)
+    {
+        sketchBits = bits;
+    }
+
+    void Publish(const std::shared_ptr<DetectResult>& next)
+    {
+        if(sketchBits > 0 && next->descriptors.depth() == CV_32F)
+            next->sketch = BinarySketch::Compute(next->descriptors, sketchBits);
+        result = next;
+        Retune();
+    }
+
+    // feed the keypoint count to the threshold loop and, if the threshold
+    // moved, switch to a new engine for the next frame. The old engine may be
+    // shared with the reference side, so it is replaced rather than modified
+    void Retune()
     {
-        image = _image;
-        feature->detectAndCompute(image, cv::Mat(), keypts, descriptors);
+        if(!controller.Update(result->keypts.size()))
+            return;
+        std::string key;
+        double value, lower, upper;
+        ThresholdParam(name, key, value, lower, upper);
+        params[key] = controller.Threshold();
+        feature = Factory(name, params).feature;
+    }
+
+    // sort keypoints (and their descriptor rows) into a fixed order, so that
+    // the way a detector splits work over threads cannot change the output
+    static void CanonicalOrder(std::vector<cv::KeyPoint>& keypts, cv::Mat& descriptors)
+    {
+        std::vector<int> order(keypts.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&keypts](int a, int b)
+        {
+            const cv::KeyPoint& ka = keypts[a];
+            const cv::KeyPoint& kb = keypts[b];
+            if(ka.pt.y != kb.pt.y) return ka.pt.y < kb.pt.y;
+            if(ka.pt.x != kb.pt.x) return ka.pt.x < kb.pt.x;
+            if(ka.size != kb.size) return ka.size < kb.size;
+            if(ka.angle != kb.angle) return ka.angle < kb.angle;
+            if(ka.response != kb.response) return ka.response > kb.response;
+            return ka.octave < kb.octave;
+        });
+
+        std::vector<cv::KeyPoint> sortedKeypts(keypts.size());
+        cv::Mat sortedDesc(descriptors.rows, descriptors.cols, descriptors.type());
+        for(size_t i=0; i<order.size(); i++)
+        {
+            sortedKeypts[i] = keypts[order[i]];
+            if(!descriptors.empty())
+                descriptors.row(order[i]).copyTo(sortedDesc.row(int(i)));
+        }
+        keypts.swap(sortedKeypts);
+        descriptors = sortedDesc;
     }
     
-    DetectResult getResult()
+    // latest published result, null before the first detection
+    DetectResultPtr getResult()
     {
-        return {name, image, keypts, descriptors};
+        return result;
     }
 
     std::string GetName() { return name; }
 };
 
 
+// matches between one reference and one input DetectResult, which it keeps alive.
+// immutable once published through MatcherResultPtr
 struct MatcherResult
 {
-    const std::string name;
-    const std::vector<cv::DMatch>& matches;
+    std::string name;
+    DetectResultPtr refer;
+    DetectResultPtr input;
+    std::vector<cv::DMatch> matches;
+    cv::Mat homography;             // reference -> input, empty if not found
+    std::vector<char> inlierMask;   // per match, empty if no homography
+    int numInliers;
+    long frame;                     // MatchHandler frame index
+    long unchangedSince;            // see MatchHandler::UnchangedSince
+
+    void Recycle()
+    {
+        refer.reset();
+        input.reset();
+        matches.clear();
+        homography.release();
+        inlierMask.clear();
+        numInliers = 0;
+        frame = unchangedSince = -1;
+    }
 };
+typedef std::shared_ptr<const MatcherResult> MatcherResultPtr;
 
 
 class Matcher
 {
     MatcherPtr matcher;
     std::string name;
-    std::vector<cv::DMatch> matches;
+    ResultPool<MatcherResult> pool;
+    std::shared_ptr<SketchMatcher> sketch;
     const int minMathces = 10;
 
 public:
@@ -102,19 +429,154 @@ public:
             else
                 return Matcher(name, cv::BFMatcher::create(cv::NORM_L1));
         }
+        else if(name == "sketch")
+        {
+            // Hamming shortlist over sketches, exact L2 re-ranking;
+            // binary descriptors are already sketches
+            Matcher result(name, cv::BFMatcher::create(cv::NORM_HAMMING));
+            if(descName != "orb" && descName != "brisk")
+                result.sketch = std::make_shared<SketchMatcher>(8, cv::NORM_L2);
+            return result;
+        }
         else
             throw std::string("error");
     }
     
-    std::vector<cv::DMatch>& MatchDescriptors(cv::Mat referDesc, cv::Mat inputDesc)
+    // match input against reference and fit a homography; the result is
+    // returned unpublished so the caller can annotate it before sharing
+    // a guide homography (reference -> input) drops matches whose input point
+    // lies further than guideRadius from the predicted position
+    std::shared_ptr<MatcherResult> Match(const DetectResultPtr& refer, const DetectResultPtr& input,
+                                         const cv::Mat& guide=cv::Mat(), float guideRadius=0)
+    {
+        std::shared_ptr<MatcherResult> result = pool.Acquire();
+        result->name = name;
+        result->refer = refer;
+        result->input = input;
+        if(sketch)
+        {
+            cv::Mat referSketch = refer->sketch.empty() ? BinarySketch::Compute(refer->descriptors, SketchBits) : refer->sketch;
+            cv::Mat inputSketch = input->sketch.empty() ? BinarySketch::Compute(input->descriptors, SketchBits) : input->sketch;
+            sketch->Match(refer->descriptors, referSketch, input->descriptors, inputSketch, result->matches);
+        }
+        else
+            RawMatch(refer->descriptors, input->descriptors, result->matches);
+        if(!guide.empty())
+            KeepGuided(*result, guide, guideRadius);
+        KeepBest(result->matches);
+        result->numInliers = EstimateHomography(*result);
+        return result;
+    }
+
+    std::vector<cv::DMatch>& MatchDescriptors(cv::Mat referDesc, cv::Mat inputDesc,
+                                              std::vector<cv::DMatch>& matches)
+    {
+        RawMatch(referDesc, inputDesc, matches);
+        KeepBest(matches);
+        return matches;
+    }
+
+    // nearest reference descriptor for every input descriptor
+    void RawMatch(cv::Mat referDesc, cv::Mat inputDesc, std::vector<cv::DMatch>& matches)
+    {
+        if(ExecutionPolicy::Current().deterministic && name == "flann")
+        {
+            // FLANN builds randomized trees/hash tables from the global std::rand,
+            // so index construction is serialized and reseeded in deterministic mode
+            static std::mutex flannMutex;
+            std::lock_guard<std::mutex> lock(flannMutex);
+            cvflann::seed_random(ExecutionPolicy::Current().seed);
+            matcher->match(inputDesc, referDesc, matches);
+        }
+        else
+            matcher->match(inputDesc, referDesc, matches);
+    }
+
+    // build the matcher index once for a reference that serves many queries
+    void Train(cv::Mat referDesc)
+    {
+        matcher->clear();
+        matcher->add(std::vector<cv::Mat>{referDesc});
+        matcher->train();
+    }
+
+    // nearest trained reference descriptor for every input descriptor
+    void MatchTrained(cv::Mat inputDesc, std::vector<cv::DMatch>& matches)
+    {
+        matcher->match(inputDesc, matches);
+    }
+
+    // k nearest trained reference descriptors for every input descriptor
+    void KnnTrained(cv::Mat inputDesc, int k, std::vector<std::vector<cv::DMatch>>& matches)
     {
+        matcher->knnMatch(inputDesc, matches, k);
+    }
+
+    // keep matches consistent with the guide homography
+    static void KeepGuided(MatcherResult& result, const cv::Mat& guide, float radius)
+    {
+        if(result.matches.empty())
+            return;
+        std::vector<cv::Point2f> referPts, predicted;
+        for(const cv::DMatch& m : result.matches)
+            referPts.push_back(result.refer->keypts[m.trainIdx].pt);
+        cv::perspectiveTransform(referPts, predicted, guide);
 
-        matcher->match(inputDesc, referDesc, matches);
+        const float r2 = radius * radius;
+        size_t kept = 0;
+        for(size_t i=0; i<result.matches.size(); i++)
+        {
+            const cv::Point2f d = result.input->keypts[result.matches[i].queryIdx].pt - predicted[i];
+            if(d.x*d.x + d.y*d.y <= r2)
+                result.matches[kept++] = result.matches[i];
+        }
+        result.matches.resize(kept);
+    }
 
-        std::sort(matches.begin(), matches.end());
+    // keep the AcceptRatio() best matches
+    static void KeepBest(std::vector<cv::DMatch>& matches)
+    {
+        // total order: equal distances are broken by indices, not by sort internals
+        std::sort(matches.begin(), matches.end(), MatchOrder);
         const int numGoodMatches = matches.size() * AcceptRatio();
         matches.erase(matches.begin()+numGoodMatches, matches.end());
-        
+    }
+
+    // sketch length used by "sketch" matchers
+    static const int SketchBits = 256;
+
+    // two-stage matcher of a "sketch" pair, null for other matchers
+    std::shared_ptr<SketchMatcher> Sketch() { return sketch; }
+
+    // fit a reference -> input homography to the current matches with RANSAC
+    // and return the number of inliers, 0 if there are too few matches.
+    // OpenCV's RANSAC uses a fixed internal seed, so this is reproducible
+    int EstimateHomography(MatcherResult& result)
+    {
+        result.homography.release();
+        result.inlierMask.clear();
+        if(int(result.matches.size()) < minMathces)
+            return 0;
+
+        std::vector<cv::Point2f> referPts, inputPts;
+        for(const cv::DMatch& m : result.matches)
+        {
+            referPts.push_back(result.refer->keypts[m.trainIdx].pt);
+            inputPts.push_back(result.input->keypts[m.queryIdx].pt);
+        }
+        std::vector<uchar> mask;
+        result.homography = cv::findHomography(referPts, inputPts, cv::RANSAC, 3.0, mask);
+        if(result.homography.empty())
+            return 0;
+        result.inlierMask.assign(mask.begin(), mask.end());
+        return int(std::count(mask.begin(), mask.end(), 1));
+    }
+
+    static bool MatchOrder(const cv::DMatch& a, const cv::DMatch& b)
+    {
+        if(a.distance != b.distance) return a.distance < b.distance;
+        if(a.queryIdx != b.queryIdx) return a.queryIdx < b.queryIdx;
+        return a.trainIdx < b.trainIdx;
     }
     
     static float& AcceptRatio()
@@ -123,76 +585,180 @@ public:
         return acceptRatio;
     }
 
-    MatcherResult getResult()
-    {
-        return {name, matches};
-    }
+    std::string GetName() { return name; }
 };
 
-class MatchHandler
+// ResolutionController chooses the detection scale of each input frame
+// from the smoothed frame latency and a target FPS.
+// Hysteresis: a level is held for a few frames, and scaling up only happens
+// when the latency predicted at the larger scale still fits in the budget.
+class ResolutionController
 {
-    std::vector<Detector> referDets;
-    std::vector<Detector> inputDets;
-    std::vector<Matcher> matchers;
-    float acceptRatio;
+    std::vector<float> levels;
+    size_t level;
+    double targetFps;
+    double avgLatency;      // exponential moving average in ms, < 0 before the first frame
+    int framesAtLevel;
+    const int holdFrames = 10;
+    const double smoothing = 0.2;
+    const double upMargin = 0.8;
 
 public:
-    // create feature detectors and matchers depending on string inputs
-    MatchHandler(const std::vector<std::string> features, 
-                 const std::vector<std::string> matcher)
-                 : acceptRatio(0.5f)
+    ResolutionController()
+        : levels({1.f, 0.75f, 0.5f, 0.35f}), level(0), targetFps(0), 
+          avgLatency(-1), framesAtLevel(0) {}
+
+    // fps <= 0 disables scaling
+    void SetTargetFps(double fps)
     {
-        assert(features.size() == matcher.size());
-        for(const std::string& feat : features)
-            referDets.push_back( Detector::Factory(feat) );
-        for(const std::string& feat : features)
-            inputDets.push_back( Detector::Factory(feat) );
-        for(int i=0; i<matcher.size(); i++)
-            matchers.push_back(Matcher::Factory(matcher[i], inputDets[i].getResult().name));
+        targetFps = fps;
+        level = 0;
+        avgLatency = -1;
+        framesAtLevel = 0;
     }
 
-    // detect features and compute descriptors on reference image for all feature types
-    void SetRefImage(cv::Mat refimg)
+    float Scale() const { return levels[level]; }
+
+    // feed the latency of the frame processed at Scale()
+    void Report(double latencyMs)
     {
-        for(auto& det: referDets)
-            det.DetectAndCompute(refimg);
+        if(targetFps <= 0)
+            return;
+        // after a level change the average continues from its rescaled value
+        avgLatency = avgLatency < 0 ? latencyMs
+                   : (1 - smoothing) * avgLatency + smoothing * latencyMs;
+        if(++framesAtLevel < holdFrames)
+            return;
+
+        const double budget = 1000.0 / targetFps;
+        if(avgLatency > budget && level + 1 < levels.size())
+            ChangeLevel(level + 1);
+        else if(level > 0)
+        {
+            // detection cost grows roughly with pixel count
+            const double ratio = levels[level-1] / levels[level];
+            if(avgLatency * ratio * ratio < budget * upMargin)
+                ChangeLevel(level - 1);
+        }
     }
 
-    // detect features and compute descriptors on input image for all feature types
-    // match input descriptors with reference descriptors
-    void MatchImage(cv::Mat inpimg)
+private:
+    void ChangeLevel(size_t newLevel)
     {
-        for(auto& det: inputDets)
-            det.DetectAndCompute(inpimg);
+        const double ratio = levels[newLevel] / levels[level];
+        avgLatency *= ratio * ratio;
+        level = newLevel;
+        framesAtLevel = 0;
+    }
+};
 
-        for(size_t i=0; i<matchers.size(); i++)
+
+// HomographyStability follows the homography and inlier set of one
+// detector/matcher pair and reports since which frame they are unchanged,
+// so identical results need not be drawn or processed again
+class HomographyStability
+{
+    cv::Mat homography;
+    std::vector<int> inliers;       // sorted reference keypoint indices
+    long since;
+    const double maxCornerShift = 1.5;  // pixels
+    const double minOverlap = 0.9;      // Jaccard index of the inlier sets
+
+public:
+    HomographyStability() : since(-1) {}
+
+    void Reset()
+    {
+        homography.release();
+        inliers.clear();
+        since = -1;
+    }
+
+    // first frame of the current stable run, -1 if there is no homography
+    long Since() const { return since; }
+
+    // true if the result of this frame matches the previous one within tolerance
+    bool Update(long frame, cv::Size refSize, const MatcherResult& match)
+    {
+        std::vector<int> current;
+        for(size_t i=0; i<match.inlierMask.size(); i++)
+            if(match.inlierMask[i])
+                current.push_back(match.matches[i].trainIdx);
+        std::sort(current.begin(), current.end());
+
+        const bool unchanged = !match.homography.empty() && !homography.empty()
+                               && CornerShift(match.homography, refSize) <= maxCornerShift
+                               && Overlap(current) >= minOverlap;
+        if(!unchanged)
         {
-            matchers[i].MatchDescriptors(referDets[i].getResult().descriptors, 
-                                         inputDets[i].getResult().descriptors);
+            homography = match.homography.clone();
+            inliers.swap(current);
+            since = homography.empty() ? -1 : frame;
         }
+        return unchanged;
     }
 
-    // change minimum inlier ratio in Matcher class
-    void ChangeAcceptRatio(float change)
+private:
+    // largest displacement of the reference corners between old and new homography
+    double CornerShift(const cv::Mat& newHomography, cv::Size refSize) const
     {
-        std::cout<<" Change number: "<<change<<std::endl;
-        acceptRatio += change;
-        acceptRatio = std::max(std::min(acceptRatio, 1.f), 0.f);
-        std::cout<<"Ratio:"<<acceptRatio<<std::endl;
-        Matcher::AcceptRatio() = acceptRatio;
+        std::vector<cv::Point2f> corners = {
+            {0.f, 0.f}, {float(refSize.width), 0.f},
+            {float(refSize.width), float(refSize.height)}, {0.f, float(refSize.height)}};
+        std::vector<cv::Point2f> oldPts, newPts;
+        cv::perspectiveTransform(corners, oldPts, homography);
+        cv::perspectiveTransform(corners, newPts, newHomography);
+        double shift = 0;
+        for(size_t i=0; i<corners.size(); i++)
+            shift = std::max(shift, cv::norm(oldPts[i] - newPts[i]));
+        return shift;
     }
 
-    // draw match
-    cv::Mat DrawMatchResult(int maxHeight=1000)
+    double Overlap(const std::vector<int>& current) const
     {
+        std::vector<int> common;
+        std::set_intersection(inliers.begin(), inliers.end(), current.begin(), current.end(),
+                              std::back_inserter(common));
+        const size_t unionSize = inliers.size() + current.size() - common.size();
+        return unionSize == 0 ? 1.0 : double(common.size()) / unionSize;
+    }
+};
+
+
+// ResultRenderer draws MatcherResults stacked vertically. A pair whose
+// result is unchanged since a frame already drawn reuses that drawing.
+// Independent of MatchHandler, so rendering can run on another thread
+class ResultRenderer
+{
+    std::vector<std::string> names;
+    std::vector<long> drawnSince;
+    std::vector<cv::Mat> cache;
+
+public:
+    cv::Mat Draw(const std::vector<MatcherResultPtr>& results, int maxHeight=1000)
+    {
+        names.resize(results.size());
+        drawnSince.resize(results.size(), -1);
+        cache.resize(results.size());
+
         std::vector<cv::Mat> resultImgs;
-        for(size_t i=0; i<matchers.size(); i++)
+        for(size_t i=0; i<results.size(); i++)
         {
-            cv::Mat result = DrawSingleResult(
-                referDets[i].getResult(), inputDets[i].getResult(), matchers[i].getResult()
-            );
-            resultImgs.push_back(result);
+            if(!results[i])
+                continue;
+            const MatcherResult& match = *results[i];
+            const bool unchanged = match.unchangedSince >= 0 && match.unchangedSince < match.frame;
+            if(cache[i].empty() || names[i] != match.name || !unchanged
+               || drawnSince[i] != match.unchangedSince)
+            {
+                cache[i] = DrawSingleResult(match);
+                names[i] = match.name;
+                drawnSince[i] = match.unchangedSince;
+            }
+            resultImgs.push_back(cache[i]);
         }
+        if(resultImgs.empty())
+            return cv::Mat();
         cv::Mat stackedResult;
         cv::vconcat(resultImgs, stackedResult);
         if(stackedResult.rows > maxHeight)
@@ -200,7 +766,7 @@ public:
         return stackedResult;
     }
 
-    cv::Mat DrawSingleResult(DetectResult refDet, DetectResult inpDet, MatcherResult match)
+    static cv::Mat DrawSingleResult(const MatcherResult& match)
     {
         cv::Mat result_;
         cv::Mat matchimg;
@@ -209,7 +775,7 @@ public:
         {
             // The drawMatches Fusion has a high probability of error occurring. 
             // So, I use try, catch function
-            cv::drawMatches(inpDet.image, inpDet.keypts, refDet.image, refDet.keypts, match.matches, matchimg );    
+            cv::drawMatches(match.input->image, match.input->keypts, match.refer->image, match.refer->keypts, match.matches, matchimg );    
         }
         catch(const std::exception& e)
         {
@@ -218,7 +784,7 @@ public:
         
 
 
-        cv::putText(matchimg, inpDet.name, cv::Point(10,30),
+        cv::putText(matchimg, match.input->name, cv::Point(10,30),
                         cv::FONT_HERSHEY_SIMPLEX, 1, cv::Scalar::all(0), 2);
 
         if(result_.empty())
@@ -241,5 +807,1157 @@ public:
         return resimg;
 
     }
+};
+
+
+// correspondences pooled from every feature type and one homography fitted to them
+struct FusedResult
+{
+    std::vector<cv::Point2f> referPts;
+    std::vector<cv::Point2f> inputPts;
+    std::vector<float> weights;
+    std::vector<int> sources;       // index of the pair each correspondence came from
+    cv::Mat homography;             // reference -> input, empty if not found
+    std::vector<char> inlierMask;
+    int numInliers;
+    long frame;
+};
+typedef std::shared_ptr<const FusedResult> FusedResultPtr;
+
+
+// CorrespondenceFusion pools the matches of all detector/matcher pairs into
+// one weighted set, drops correspondences that several feature types found at
+// the same place, and runs a single RANSAC over the rest. Diversity of feature
+// types then gives the robustness otherwise bought with expensive settings
+class CorrespondenceFusion
+{
+    std::map<std::string, float> typeWeights;   // by feature name, default 1
+    float dedupRadius;                          // pixels, in both images
+    static const int minCorrespondences = 10;
+
+public:
+    CorrespondenceFusion(float _dedupRadius=2.f) : dedupRadius(_dedupRadius) {}
+
+    void SetTypeWeight(const std::string feature, float weight)
+    {
+        typeWeights[feature] = weight;
+    }
+
+    FusedResultPtr Fuse(const std::vector<MatcherResultPtr>& results, long frame) const
+    {
+        std::shared_ptr<FusedResult> fused = std::make_shared<FusedResult>();
+        fused->numInliers = 0;
+        fused->frame = frame;
+        Pool(results, *fused);
+        Deduplicate(*fused);
+        Estimate(*fused);
+        return fused;
+    }
+
+private:
+    // distances are not comparable across norms, so each match is weighted
+    // by its distance relative to the median of its own pair
+    void Pool(const std::vector<MatcherResultPtr>& results, FusedResult& fused) const
+    {
+        for(size_t r=0; r<results.size(); r++)
+        {
+            if(!results[r] || results[r]->matches.empty())
+                continue;
+            const MatcherResult& match = *results[r];
+            auto typeWeight = typeWeights.find(match.input->name);
+            const float weight = typeWeight == typeWeights.end() ? 1.f : typeWeight->second;
+
+            std::vector<float> distances;
+            for(const cv::DMatch& m : match.matches)
+                distances.push_back(m.distance);
+            std::nth_element(distances.begin(), distances.begin() + distances.size()/2, distances.end());
+            const float median = std::max(distances[distances.size()/2], 1e-6f);
+
+            for(const cv::DMatch& m : match.matches)
+            {
+                fused.referPts.push_back(match.refer->keypts[m.trainIdx].pt);
+                fused.inputPts.push_back(match.input->keypts[m.queryIdx].pt);
+                fused.weights.push_back(weight * median / (median + m.distance));
+                fused.sources.push_back(int(r));
+            }
+        }
+    }
+
+    // keep the heaviest of correspondences that agree within dedupRadius
+    // in both the input and the reference image
+    void Deduplicate(FusedResult& fused) const
+    {
+        std::vector<int> order(fused.weights.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&fused](int a, int b)
+        {
+            return fused.weights[a] > fused.weights[b];
+        });
+
+        auto cellKey = [](int cx, int cy) { return (int64_t(cx) << 32) ^ uint32_t(cy); };
+        std::unordered_map<int64_t, std::vector<int>> grid;
+        const float r2 = dedupRadius * dedupRadius;
+        auto near = [r2](cv::Point2f a, cv::Point2f b)
+        {
+            const float dx = a.x - b.x, dy = a.y - b.y;
+            return dx*dx + dy*dy <= r2;
+        };
+
+        FusedResult kept;
+        for(int idx : order)
+        {
+            const cv::Point2f& p = fused.inputPts[idx];
+            const int cx = int(std::floor(p.x / dedupRadius));
+            const int cy = int(std::floor(p.y / dedupRadius));
+            bool duplicate = false;
+            for(int dy=-1; dy<=1 && !duplicate; dy++)
+                for(int dx=-1; dx<=1 && !duplicate; dx++)
+                {
+                    auto cell = grid.find(cellKey(cx+dx, cy+dy));
+                    if(cell == grid.end())
+                        continue;
+                    for(int other : cell->second)
+                        if(near(p, fused.inputPts[other]) && near(fused.referPts[idx], fused.referPts[other]))
+                        {
+                            duplicate = true;
+                            break;
+                        }
+                }
+            if(duplicate)
+                continue;
+            grid[cellKey(cx, cy)].push_back(idx);
+            kept.referPts.push_back(fused.referPts[idx]);
+            kept.inputPts.push_back(p);
+            kept.weights.push_back(fused.weights[idx]);
+            kept.sources.push_back(fused.sources[idx]);
+        }
+        // kept is ordered by decreasing weight, as PROSAC expects
+        fused.referPts.swap(kept.referPts);
+        fused.inputPts.swap(kept.inputPts);
+        fused.weights.swap(kept.weights);
+        fused.sources.swap(kept.sources);
+    }
+
+    void Estimate(FusedResult& fused) const
+    {
+        if(int(fused.referPts.size()) < minCorrespondences)
+            return;
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 5)
+        // PROSAC samples the heaviest correspondences first
+        const int method = cv::USAC_PROSAC;
+#else
+        const int method = cv::RANSAC;
+#endif
+        std::vector<uchar> mask;
+        fused.homography = cv::findHomography(fused.referPts, fused.inputPts, method, 3.0, mask);
+        if(fused.homography.empty())
+            return;
+        fused.inlierMask.assign(mask.begin(), mask.end());
+        fused.numInliers = int(std::count(mask.begin(), mask.end(), 1));
+    }
+};
+
+
+// CoarseLocator finds the reference in a thumbnail of the input with ORB and
+// turns the thumbnail homography into a full resolution estimate, so the
+// expensive full resolution pass only has to look where the reference is
+class CoarseLocator
+{
+    Detector refer;
+    Detector input;
+    Matcher matcher;
+    int thumbWidth;
+    float margin;           // region growth, fraction of the region size
+    float referScale;
+    cv::Size referSize;
+
+public:
+    CoarseLocator(int _thumbWidth=320, float _margin=0.15f)
+        : refer(Detector::Factory("orb")), input(refer.Share()), matcher(Matcher::Factory("bf", "orb")),
+          thumbWidth(_thumbWidth), margin(_margin), referScale(1.f) {}
+
+    void SetReference(cv::Mat refimg)
+    {
+        referSize = refimg.size();
+        referScale = ThumbScale(refimg);
+        refer.DetectAndCompute(Thumbnail(refimg, referScale));
+    }
+
+    // reference -> input homography at full resolution, empty if the
+    // thumbnail pass failed; region is the predicted area of the reference
+    // in the input, grown by the margin and clipped to the image.
+    // a half-scale copy of inpimg, if available, makes the thumbnail cheaper
+    cv::Mat Locate(cv::Mat inpimg, cv::Rect& region, const cv::Mat& half=cv::Mat())
+    {
+        region = cv::Rect();
+        if(!refer.getResult())
+            return cv::Mat();
+        const float inputScale = ThumbScale(inpimg);
+        cv::Mat thumb;
+        if(!half.empty() && inputScale <= 0.5f)
+            cv::resize(half, thumb, cv::Size(cvRound(inpimg.cols * inputScale), cvRound(inpimg.rows * inputScale)),
+                       0, 0, cv::INTER_AREA);
+        else
+            thumb = Thumbnail(inpimg, inputScale);
+        input.DetectAndCompute(thumb);
+        std::shared_ptr<MatcherResult> match = matcher.Match(refer.getResult(), input.getResult());
+        if(match->homography.empty())
+            return cv::Mat();
+
+        // full = S_input^-1 * thumb * S_refer
+        cv::Mat referToThumb = (cv::Mat_<double>(3,3) << referScale, 0, 0, 0, referScale, 0, 0, 0, 1);
+        cv::Mat thumbToInput = (cv::Mat_<double>(3,3) << 1.0/inputScale, 0, 0, 0, 1.0/inputScale, 0, 0, 0, 1);
+        cv::Mat homography = thumbToInput * match->homography * referToThumb;
+
+        std::vector<cv::Point2f> corners = {
+            {0.f, 0.f}, {float(referSize.width), 0.f},
+            {float(referSize.width), float(referSize.height)}, {0.f, float(referSize.height)}};
+        std::vector<cv::Point2f> projected;
+        cv::perspectiveTransform(corners, projected, homography);
+        cv::Rect box = cv::boundingRect(projected);
+        const int growX = int(box.width * margin), growY = int(box.height * margin);
+        box = cv::Rect(box.x - growX, box.y - growY, box.width + 2*growX, box.height + 2*growY);
+        region = box & cv::Rect(0, 0, inpimg.cols, inpimg.rows);
+        if(region.width < 32 || region.height < 32)
+        {
+            region = cv::Rect();
+            return cv::Mat();
+        }
+        return homography;
+    }
+
+private:
+    float ThumbScale(const cv::Mat& image) const
+    {
+        return image.cols > thumbWidth ? float(thumbWidth) / image.cols : 1.f;
+    }
+
+    static cv::Mat Thumbnail(const cv::Mat& image, float scale)
+    {
+        if(scale >= 1.f)
+            return image;
+        cv::Mat thumb;
+        cv::resize(image, thumb, cv::Size(), scale, scale, cv::INTER_AREA);
+        return thumb;
+    }
+};
+
+
+// a frame kept as matching reference in visual odometry mode
+struct Keyframe
+{
+    long frame;
+    std::vector<DetectResultPtr> features;  // per pair, null if the pair did not run
+    cv::Mat fromOrigin;                     // first keyframe -> this one
+    bool anchored;                          // false if promoted while lost: fromOrigin is the last valid pose
+};
+
+
+// KeyframeStore holds the keyframes of visual odometry mode. Each frame is
+// matched against the newest keyframe and becomes the next one when less
+// than minOverlap of the keyframe's keypoints are still inside it, or when
+// no pair found a homography
+class KeyframeStore
+{
+    std::deque<Keyframe> keyframes;
+    float minOverlap;
+    size_t capacity;
+    cv::Mat pose;
+    bool lost;
+    long breaks;
 
+public:
+    KeyframeStore(float _minOverlap=0.6f, size_t _capacity=32)
+        : minOverlap(_minOverlap), capacity(std::max<size_t>(_capacity, 1)), lost(false), breaks(0) {}
+
+    // features of the current keyframe for one pair
+    DetectResultPtr Current(size_t pair) const
+    {
+        if(keyframes.empty() || pair >= keyframes.back().features.size())
+            return nullptr;
+        return keyframes.back().features[pair];
+    }
+
+    const std::deque<Keyframe>& Keyframes() const { return keyframes; }
+
+    // first keyframe -> last frame homography; while lost it stays at the
+    // last valid pose
+    cv::Mat Pose() const { return pose; }
+
+    // the last frame had no homography to its keyframe
+    bool Lost() const { return lost; }
+
+    // times tracking was lost and the chain re-anchored on a guessed pose,
+    // each a possible jump in Pose()
+    long Breaks() const { return breaks; }
+
+    void Reset()
+    {
+        keyframes.clear();
+        pose = cv::Mat();
+        lost = false;
+        breaks = 0;
+    }
+
+    // follow the frame's matches against the current keyframe, promoting
+    // the frame's own detections to keyframe if needed; returns true on promotion
+    bool Update(long frame, const std::vector<MatcherResultPtr>& results, const std::vector<DetectResultPtr>& inputs)
+    {
+        if(keyframes.empty())
+        {
+            pose = cv::Mat::eye(3, 3, CV_64F);
+            lost = false;
+            Promote(frame, inputs);
+            return true;
+        }
+
+        MatcherResultPtr best;
+        for(const MatcherResultPtr& result : results)
+            if(result && !result->homography.empty() && (!best || result->numInliers > best->numInliers))
+                best = result;
+        if(!best)
+        {
+            // keep the last valid pose and continue the chain from this frame,
+            // assuming it was not far from where tracking was lost
+            if(!lost)
+                breaks++;
+            lost = true;
+            Promote(frame, inputs);
+            return true;
+        }
+
+        lost = false;
+        pose = best->homography * keyframes.back().fromOrigin;
+        if(Overlap(best->homography, *best->refer, best->input->image.size()) >= minOverlap)
+            return false;
+        Promote(frame, inputs);
+        return true;
+    }
+
+    // fraction of the reference keypoints the homography maps inside an image of size
+    static float Overlap(const cv::Mat& homography, const DetectResult& refer, cv::Size size)
+    {
+        if(refer.keypts.empty())
+            return 0.f;
+        std::vector<cv::Point2f> points, projected;
+        cv::KeyPoint::convert(refer.keypts, points);
+        cv::perspectiveTransform(points, projected, homography);
+        const cv::Rect2f bounds(0.f, 0.f, float(size.width), float(size.height));
+        int inside = 0;
+        for(const cv::Point2f& p : projected)
+            inside += bounds.contains(p);
+        return float(inside) / projected.size();
+    }
+
+private:
+    void Promote(long frame, const std::vector<DetectResultPtr>& inputs)
+    {
+        keyframes.push_back({frame, inputs, pose.clone(), !lost});
+        if(keyframes.size() > capacity)
+            keyframes.pop_front();
+    }
+};
+
+
+// how often one cascade stage ran and how often it verified the frame
+struct CascadeStageStats
+{
+    std::string name;
+    long runs;
+    long hits;
+
+    double HitRate() const { return runs ? double(hits) / runs : 0.0; }
+};
+
+
+// one detector/matcher pair of a MatchHandler configuration
+struct PairConfig
+{
+    std::string feature;
+    std::string matcher;
+    DetectorParams params;
+};
+
+
+// detectors and matchers of one configuration, built off the processing thread
+struct PipelineSet
+{
+    std::vector<Detector> referDets;
+    std::vector<Detector> inputDets;
+    std::vector<Matcher> matchers;
+    long refVersion;
+};
+
+
+// a reference described on the background lane, waiting to be swapped in
+struct EnrolledReference
+{
+    std::vector<Detector> referDets;
+    cv::Mat image;
+    long pairsVersion;      // detector set it was described with
+};
+
+
+// user commands delivered to MatchHandler from the UI thread
+enum class HandlerCommand
+{
+    ChangeReference,
+    RatioUp,
+    RatioDown,
+    Quit
+};
+
+
+class MatchHandler
+{
+    std::vector<Detector> referDets;
+    std::vector<Detector> inputDets;
+    std::vector<Matcher> matchers;
+    float acceptRatio;
+    ResolutionController resolution;
+    AffineSimulator refViews;
+    AffineSimulator inputViews;
+    long frameCount;
+    std::vector<HomographyStability> stability;
+    std::vector<MatcherResultPtr> results;
+    ResultRenderer renderer;
+    cv::Range targetKeypoints;
+    Preprocessor preprocessor;
+    // cascade mode: pairs run cheapest first until one verifies the frame
+    int cascadeMinInliers;
+    std::vector<int> cascadeOrder;
+    std::vector<CascadeStageStats> cascadeStats;
+    // fusion of all pairs into one geometric estimate
+    bool fusionEnabled;
+    CorrespondenceFusion fusion;
+    FusedResultPtr fused;
+    // coarse-to-fine: thumbnail localization before the full resolution pass
+    std::unique_ptr<CoarseLocator> coarse;
+    float guideRadius;
+    // overload degradation, see SetDegradeLevel
+    int degradeLevel;
+    // whole-image retrieval over a reference collection
+    std::shared_ptr<const GlobalIndex> globalIndex;
+    size_t globalPair;
+    std::string globalFeature;  // finds globalPair again after Reconfigure
+    // visual odometry: keyframes replace the reference image
+    std::unique_ptr<KeyframeStore> odometry;
+    std::vector<DetectResultPtr> frameInputs;
+    // persistent keypoint tracks on one pair's detections
+    std::unique_ptr<TrackManager> tracks;
+    size_t trackPair;
+    std::string trackFeature;
+    int sketchShortlist;        // 0 keeps the sketch matchers' default
+    SpscQueue<HandlerCommand, 64> commands;
+
+    // reference image and simulated views, also read by background rebuilds
+    std::mutex refMutex;
+    cv::Mat refImage;
+    long refVersion;
+    // configuration built by Reconfigure, swapped in before the next frame
+    std::mutex pendingMutex;
+    std::unique_ptr<PipelineSet> pending;
+    long pairsVersion;
+    // reference enrolled in the background, swapped in before the next frame
+    std::mutex enrollMutex;
+    std::condition_variable enrollDone;
+    std::shared_ptr<EnrolledReference> enrolled;
+    int enrollsRunning;
+
+public:
+    // create feature detectors and matchers depending on string inputs
+    MatchHandler(const std::vector<std::string> features, 
+                 const std::vector<std::string> matcher)
+                 : acceptRatio(0.5f), frameCount(0), targetKeypoints(0, 0), cascadeMinInliers(0), fusionEnabled(false), guideRadius(0), degradeLevel(0), globalPair(0), trackPair(0), sketchShortlist(0), refVersion(0), pairsVersion(0), enrollsRunning(0)
+    {
+        assert(features.size() == matcher.size());
+        std::vector<PairConfig> configs;
+        for(size_t i=0; i<features.size(); i++)
+            configs.push_back({features[i], matcher[i], DetectorParams()});
+        BuildPairs(configs, referDets, inputDets, matchers);
+        ResetPairState();
+    }
+
+    // background enrollments still refer to this handler
+    ~MatchHandler()
+    {
+        std::unique_lock<std::mutex> lock(enrollMutex);
+        enrollDone.wait(lock, [this] { return enrollsRunning == 0; });
+    }
+
+    // build a new detector/matcher set and describe the current reference
+    // with it; may be called from any thread while frames are processed.
+    // the new set replaces the old one atomically before the next frame.
+    // returns false and keeps the running set if the configuration is invalid
+    bool Reconfigure(const std::vector<PairConfig>& configs)
+    {
+        std::unique_ptr<PipelineSet> set(new PipelineSet);
+        try
+        {
+            if(configs.empty())
+                throw std::string("empty configuration");
+            BuildPairs(configs, set->referDets, set->inputDets, set->matchers);
+
+            cv::Mat ref;
+            AffineSimulator views;
+            {
+                std::lock_guard<std::mutex> lock(refMutex);
+                ref = refImage;
+                views = refViews;
+                set->refVersion = refVersion;
+            }
+            if(!ref.empty())
+                DescribeReference(set->referDets, ref, views, true);
+        }
+        catch(const std::string& e)
+        {
+            std::cerr << "reconfigure failed: " << e << std::endl;
+            return false;
+        }
+        // OpenCV rejects some parameter values only when the detector runs
+        catch(const std::exception& e)
+        {
+            std::cerr << "reconfigure failed: " << e.what() << std::endl;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        pending = std::move(set);
+        return true;
+    }
+
+    // keep input keypoint counts of every detector inside [minCount, maxCount]
+    // by adapting detector thresholds frame to frame; maxCount <= 0 disables
+    void SetTargetKeypoints(int minCount, int maxCount)
+    {
+        targetKeypoints = cv::Range(minCount, maxCount);
+        ApplyKeypointTarget();
+    }
+
+    // set thread count and deterministic mode for the following frames
+    void SetExecutionPolicy(const ExecutionPolicy& policy)
+    {
+        ExecutionPolicy::Current() = policy;
+        if(policy.numThreads > 0)
+            cv::setNumThreads(policy.numThreads);
+    }
+
+    // describe the reference from several synthetic scales/rotations,
+    // so cheap non scale-invariant detectors still match large viewpoint changes.
+    // takes effect on the next SetRefImage, an empty simulator turns it off
+    void SetRefViews(const AffineSimulator& views)
+    {
+        std::lock_guard<std::mutex> lock(refMutex);
+        refViews = views;
+    }
+
+    // also simulate views of every input frame (e.g. AffineSimulator::Asift()),
+    // much more expensive than reference-side simulation
+    void SetInputViews(const AffineSimulator& views)
+    {
+        inputViews = views;
+    }
+
+    // fused color conversion / undistortion / resize / blur applied to the
+    // reference and every input frame of this stream before detection;
+    // keypoints and drawings are then in preprocessed image coordinates.
+    // its half-scale output feeds the coarse-to-fine thumbnail pass, so
+    // enable it only together with SetCoarseToFine
+    void SetPreprocessor(const Preprocessor& _preprocessor)
+    {
+        preprocessor = _preprocessor;
+    }
+
+    // detect features and compute descriptors on reference image for all feature types
+    void SetRefImage(cv::Mat refimg)
+    {
+        if(preprocessor.Enabled())
+            refimg = preprocessor.Run(refimg);
+        AffineSimulator views;
+        {
+            std::lock_guard<std::mutex> lock(refMutex);
+            refImage = refimg;
+            refVersion++;
+            views = refViews;
+        }
+        DescribeReference(referDets, refimg, views);
+        ReferenceChanged(refimg);
+    }
+
+    // like SetRefImage, but the reference is preprocessed and described on
+    // the background lane of PriorityExecutor while frames keep matching the
+    // current one; it takes over before the first frame after it is ready.
+    // call from the processing thread
+    void EnrollReference(cv::Mat refimg)
+    {
+        std::shared_ptr<EnrolledReference> enroll = std::make_shared<EnrolledReference>();
+        for(size_t i=0; i<referDets.size(); i++)
+        {
+            enroll->referDets.push_back(referDets[i].Share());
+            if(matchers[i].Sketch())
+                enroll->referDets.back().EnableSketch(Matcher::SketchBits);
+        }
+        enroll->pairsVersion = pairsVersion;
+        AffineSimulator views;
+        {
+            std::lock_guard<std::mutex> lock(refMutex);
+            views = refViews;
+        }
+        {
+            std::lock_guard<std::mutex> lock(enrollMutex);
+            enrollsRunning++;
+        }
+        Preprocessor pre = preprocessor;
+        PriorityExecutor::Instance().Submit([this, enroll, refimg, pre, views]() mutable
+        {
+            // the destructor waits for enrollsRunning, so it drops on every path
+            struct Finish
+            {
+                MatchHandler* handler;
+                std::shared_ptr<EnrolledReference> result;
+                ~Finish()
+                {
+                    std::lock_guard<std::mutex> lock(handler->enrollMutex);
+                    if(result)
+                        handler->enrolled = result;
+                    handler->enrollsRunning--;
+                    handler->enrollDone.notify_all();
+                }
+            } finish{this, nullptr};
+            try
+            {
+                enroll->image = pre.Enabled() ? pre.Run(refimg) : refimg;
+                DescribeReference(enroll->referDets, enroll->image, views, true);
+                finish.result = enroll;
+            }
+            catch(const std::string& e)
+            {
+                std::cerr << "enrollment failed: " << e << std::endl;
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "enrollment failed: " << e.what() << std::endl;
+            }
+        });
+    }
+
+    // detect features and compute descriptors on input image for all feature types
+    // match input descriptors with reference descriptors
+    // each feature type runs as an independent task writing only its own slot,
+    // so the merged result does not depend on task scheduling
+    // when a target FPS is set, the frame is detected at the scale chosen by
+    // ResolutionController; keypoints are still reported in input coordinates
+    // results of all pairs share inpimg without copying it, so the caller
+    // hands the buffer over (e.g. a fresh clone) and must not reuse it
+    void MatchImage(cv::Mat inpimg)
+    {
+        PriorityExecutor::LiveScope live(PriorityExecutor::Instance());
+        ApplyPendingConfig();
+        ApplyEnrolledReference();
+        const int64 start = cv::getTickCount();
+        cv::Mat half;
+        if(preprocessor.Enabled())
+            inpimg = preprocessor.Run(inpimg, &half);
+        // latency-driven scaling would make results timing dependent
+        float scale = ExecutionPolicy::Current().deterministic ? 1.f : resolution.Scale();
+        if(degradeLevel >= 2)
+            scale = std::min(scale, 0.5f);
+
+        cv::Rect region;
+        cv::Mat guide;
+        if(coarse && !odometry)
+            guide = coarse->Locate(inpimg, region, half);
+        for(auto& input : frameInputs)
+            input.reset();
+
+        if(degradeLevel >= 3)
+        {
+            for(auto& result : results)
+                result.reset();
+            MatchPair(cascadeOrder.front(), inpimg, scale, region, guide);
+        }
+        else if(cascadeMinInliers > 0)
+            MatchCascade(inpimg, scale, region, guide);
+        else
+        {
+            cv::parallel_for_(cv::Range(0, int(matchers.size())), [&](const cv::Range& range)
+            {
+                for(int i=range.start; i<range.end; i++)
+                    MatchPair(i, inpimg, scale, region, guide);
+            });
+        }
+        if(fusionEnabled)
+            fused = fusion.Fuse(results, frameCount);
+        if(odometry)
+            odometry->Update(frameCount, results, frameInputs);
+        if(tracks && trackPair < frameInputs.size() && frameInputs[trackPair])
+            tracks->Update(frameCount, frameInputs[trackPair]->keypts, frameInputs[trackPair]->descriptors);
+        frameCount++;
+
+        resolution.Report((cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency());
+    }
+
+    // process input at lower resolution when frames take longer than 1/fps,
+    // fps <= 0 always uses full resolution
+    void SetTargetFps(double fps)
+    {
+        resolution.SetTargetFps(fps);
+    }
+
+    float InputScale() const { return resolution.Scale(); }
+
+    // shed work while the input backlog grows (see AdmissionQueue):
+    // 1 halves the keypoint target range, 2 also caps the input scale at 0.5,
+    // 3 also runs only the cheapest detector/matcher pair; 0 is full quality.
+    // ignored in deterministic mode, like latency-driven scaling
+    void SetDegradeLevel(int level)
+    {
+        if(ExecutionPolicy::Current().deterministic)
+            level = 0;
+        if(level == degradeLevel)
+            return;
+        const bool fewerKeypoints = (level >= 1) != (degradeLevel >= 1);
+        degradeLevel = level;
+        if(fewerKeypoints)
+            ApplyKeypointTarget();
+    }
+
+    // run detector/matcher pairs one at a time, cheapest feature type first,
+    // and stop at the first one whose homography has at least minInliers
+    // inliers; pairs not run in a frame have no result for it.
+    // minInliers <= 0 runs every pair in parallel (default)
+    void SetCascade(int minInliers)
+    {
+        cascadeMinInliers = minInliers;
+        ResetCascade();
+    }
+
+    // per stage run and hit counts since cascade mode was (re)configured
+    const std::vector<CascadeStageStats>& CascadeStats() const
+    {
+        return cascadeStats;
+    }
+
+    // pool the correspondences of all pairs into one deduplicated, weighted
+    // set and fit a single homography to it after every frame
+    void SetFusion(bool enable, const CorrespondenceFusion& _fusion=CorrespondenceFusion())
+    {
+        fusionEnabled = enable;
+        fusion = _fusion;
+        fused.reset();
+    }
+
+    // locate the reference on a thumbnail of thumbWidth pixels first, then
+    // detect at full resolution only inside the predicted region (grown by
+    // margin) and keep matches within guideRadius pixels of the coarse
+    // homography's prediction. thumbWidth <= 0 turns it off.
+    // frames where the thumbnail pass fails are processed in full
+    void SetCoarseToFine(int thumbWidth, float margin=0.15f, float _guideRadius=25.f)
+    {
+        guideRadius = thumbWidth > 0 ? _guideRadius : 0;
+        coarse.reset(thumbWidth > 0 ? new CoarseLocator(thumbWidth, margin) : nullptr);
+        std::lock_guard<std::mutex> lock(refMutex);
+        if(coarse && !refImage.empty())
+            coarse->SetReference(refImage);
+    }
+
+    // index of reference images described with the feature type of pair
+    // `pair`, queried by Candidates(); null turns retrieval off
+    void SetGlobalIndex(std::shared_ptr<const GlobalIndex> index, size_t pair=0)
+    {
+        globalIndex = index;
+        globalPair = pair;
+        globalFeature = PairFeature(pair);
+    }
+
+    // the topK references that look most like the last frame as a whole,
+    // closest first; empty if that pair did not run on the frame
+    std::vector<GlobalIndex::Candidate> Candidates(int topK) const
+    {
+        if(!globalIndex || globalPair >= results.size() || !results[globalPair])
+            return std::vector<GlobalIndex::Candidate>();
+        return globalIndex->Search(results[globalPair]->input->descriptors, topK);
+    }
+
+    // visual odometry: match every frame against the newest keyframe instead
+    // of the reference image; a frame becomes the next keyframe when less
+    // than minOverlap of the keyframe's keypoints stay inside it. keyframes
+    // keep the frame's own detection results, so each frame is described once.
+    // coarse-to-fine localization is skipped in this mode
+    void SetOdometry(bool enable, float minOverlap=0.6f, size_t maxKeyframes=32)
+    {
+        odometry.reset(enable ? new KeyframeStore(minOverlap, maxKeyframes) : nullptr);
+    }
+
+    // follow the input keypoints of pair `pair` from frame to frame under
+    // stable ids, see TrackManager; maxTracks <= 0 turns tracking off
+    void SetTracking(int maxTracks, size_t pair=0, int historyLength=32)
+    {
+        trackPair = pair;
+        trackFeature = PairFeature(pair);
+        tracks.reset(maxTracks > 0 ? new TrackManager(maxTracks, historyLength) : nullptr);
+    }
+
+    // tracks after the last frame, null if tracking is off
+    const TrackManager* Tracks() const
+    {
+        return tracks.get();
+    }
+
+    // keyframes and pose of visual odometry mode, null if it is off
+    const KeyframeStore* Odometry() const
+    {
+        return odometry.get();
+    }
+
+    // fused estimate of the last frame, null if fusion is off
+    FusedResultPtr Fused() const
+    {
+        return fused;
+    }
+
+    // shortlist length of every "sketch" matcher: more candidates, better recall
+    void SetSketchShortlist(int shortlist)
+    {
+        sketchShortlist = shortlist;
+        for(auto& match : matchers)
+            if(match.Sketch())
+                match.Sketch()->SetShortlist(shortlist);
+    }
+
+    // print shortlist size and measured recall of every "sketch" matcher
+    void SketchReport()
+    {
+        for(size_t i=0; i<matchers.size(); i++)
+            if(matchers[i].Sketch())
+                std::cout << inputDets[i].GetName() << "/sketch  shortlist: " << matchers[i].Sketch()->Shortlist()
+                          << "  recall: " << matchers[i].Sketch()->Recall()
+                          << " (" << matchers[i].Sketch()->RecallSamples() << " samples)" << std::endl;
+    }
+
+    // index of the last processed frame
+    long FrameIndex() const { return frameCount - 1; }
+
+    // first frame since which the homography and inliers of a feature type
+    // have been unchanged within tolerance, -1 if there is no homography.
+    // UnchangedSince(i) < FrameIndex() means the last frame repeated an earlier result
+    long UnchangedSince(size_t i) const { return stability[i].Since(); }
+
+    bool IsUnchanged(size_t i) const
+    {
+        return stability[i].Since() >= 0 && stability[i].Since() < FrameIndex();
+    }
+
+    // order-sensitive hash of the current keypoints, matches, homographies
+    // and inliers, for comparing runs in regression checks
+    uint64_t ResultDigest()
+    {
+        uint64_t hash = 1469598103934665603ull;
+        auto mix = [&hash](const void* data, size_t bytes)
+        {
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            for(size_t i=0; i<bytes; i++)
+                hash = (hash ^ p[i]) * 1099511628211ull;
+        };
+        for(const MatcherResultPtr& match : results)
+        {
+            if(!match)
+                continue;
+            for(const cv::KeyPoint& kp : match->input->keypts)
+                mix(&kp.pt, sizeof(kp.pt));
+            for(const cv::KeyPoint& kp : match->refer->keypts)
+                mix(&kp.pt, sizeof(kp.pt));
+            for(const cv::DMatch& m : match->matches)
+            {
+                mix(&m.queryIdx, sizeof(m.queryIdx));
+                mix(&m.trainIdx, sizeof(m.trainIdx));
+                mix(&m.distance, sizeof(m.distance));
+            }
+            // RANSAC/USAC output, so an unseeded estimator shows up too
+            for(int r=0; r<match->homography.rows; r++)
+                mix(match->homography.ptr(r), match->homography.cols * match->homography.elemSize());
+            mix(&match->numInliers, sizeof(match->numInliers));
+            if(!match->inlierMask.empty())
+                mix(match->inlierMask.data(), match->inlierMask.size());
+        }
+        return hash;
+    }
+
+    // queue a command from the UI thread (single producer), never blocks
+    void PostCommand(HandlerCommand command)
+    {
+        if(!commands.Push(command))
+            std::cerr << "command queue full, command dropped" << std::endl;
+    }
+
+    // apply queued commands between frames on the processing thread;
+    // frame becomes the new reference on ChangeReference.
+    // returns false once Quit was received
+    bool ProcessCommands(cv::Mat frame)
+    {
+        HandlerCommand command;
+        while(commands.Pop(command))
+        {
+            switch(command)
+            {
+            case HandlerCommand::ChangeReference:
+                std::cout << "change reference image" << std::endl;
+                EnrollReference(frame.clone());
+                break;
+            case HandlerCommand::RatioUp:
+                ChangeAcceptRatio(0.1f);
+                break;
+            case HandlerCommand::RatioDown:
+                ChangeAcceptRatio(-0.1f);
+                break;
+            case HandlerCommand::Quit:
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // change minimum inlier ratio in Matcher class
+    void ChangeAcceptRatio(float change)
+    {
+        std::cout<<" Change number: "<<change<<std::endl;
+        acceptRatio += change;
+        acceptRatio = std::max(std::min(acceptRatio, 1.f), 0.f);
+        std::cout<<"Ratio:"<<acceptRatio<<std::endl;
+        Matcher::AcceptRatio() = acceptRatio;
+    }
+
+    // draw match
+    cv::Mat DrawMatchResult(int maxHeight=1000)
+    {
+        return renderer.Draw(results, maxHeight);
+    }
+
+    // results of the last frame, one per detector/matcher pair;
+    // they stay valid and unchanged however long the caller keeps them
+    std::vector<MatcherResultPtr> Results() const
+    {
+        return results;
+    }
+
+
+
+private:
+    static void BuildPairs(const std::vector<PairConfig>& configs, std::vector<Detector>& referDets,
+                           std::vector<Detector>& inputDets, std::vector<Matcher>& matchers)
+    {
+        // one engine per distinct feature/parameter combination, created on first use
+        // and shared by the reference and input side of every pair that needs it
+        std::map<std::pair<std::string, DetectorParams>, Detector> engines;
+        for(const PairConfig& config : configs)
+        {
+            auto key = std::make_pair(config.feature, config.params);
+            auto engine = engines.find(key);
+            if(engine == engines.end())
+                engine = engines.emplace(key, Detector::Factory(config.feature, config.params)).first;
+            referDets.push_back(engine->second.Share());
+            inputDets.push_back(engine->second.Share());
+            matchers.push_back(Matcher::Factory(config.matcher, config.feature));
+            if(matchers.back().Sketch())
+            {
+                // sketches are computed once per detection, not per match
+                referDets.back().EnableSketch(Matcher::SketchBits);
+                inputDets.back().EnableSketch(Matcher::SketchBits);
+            }
+        }
+    }
+
+    // background describes on PriorityExecutor's lane, one detector at a
+    // time, instead of on OpenCV's pool
+    static void DescribeReference(std::vector<Detector>& dets, cv::Mat refimg, const AffineSimulator& views,
+                                  bool background=false)
+    {
+        auto describe = [&](int i)
+        {
+            ExecutionPolicy::SeedThread();
+            if(views.Empty())
+                dets[i].DetectAndCompute(refimg);
+            else
+                dets[i].DetectAndComputeViews(refimg, views);
+        };
+        if(background)
+        {
+            PriorityExecutor& executor = PriorityExecutor::Instance();
+            executor.RunOnLane([&]
+            {
+                for(int i=0; i<int(dets.size()); i++)
+                {
+                    executor.Yield();
+                    describe(i);
+                }
+            });
+            return;
+        }
+        cv::parallel_for_(cv::Range(0, int(dets.size())), [&](const cv::Range& range)
+        {
+            for(int i=range.start; i<range.end; i++)
+                describe(i);
+        });
+    }
+
+    void ReferenceChanged(const cv::Mat& refimg)
+    {
+        if(coarse)
+            coarse->SetReference(refimg);
+        for(auto& stable : stability)
+            stable.Reset();
+    }
+
+    // swap in a reference finished by EnrollReference, between two frames
+    void ApplyEnrolledReference()
+    {
+        std::shared_ptr<EnrolledReference> enroll;
+        {
+            std::lock_guard<std::mutex> lock(enrollMutex);
+            enroll.swap(enrolled);
+        }
+        if(!enroll)
+            return;
+
+        AffineSimulator views;
+        {
+            std::lock_guard<std::mutex> lock(refMutex);
+            refImage = enroll->image;
+            refVersion++;
+            views = refViews;
+        }
+        if(enroll->pairsVersion == pairsVersion)
+            referDets.swap(enroll->referDets);
+        else
+            DescribeReference(referDets, enroll->image, views);    // pairs were reconfigured meanwhile
+        ReferenceChanged(enroll->image);
+    }
+
+    void ApplyKeypointTarget()
+    {
+        const int shift = degradeLevel >= 1 ? 1 : 0;
+        for(auto& det : inputDets)
+            det.SetTargetKeypoints(targetKeypoints.start >> shift, targetKeypoints.end >> shift);
+    }
+
+    void ResetCascade()
+    {
+        cascadeOrder.resize(matchers.size());
+        std::iota(cascadeOrder.begin(), cascadeOrder.end(), 0);
+        std::stable_sort(cascadeOrder.begin(), cascadeOrder.end(), [this](int a, int b)
+        {
+            return Detector::CostRank(inputDets[a].GetName()) < Detector::CostRank(inputDets[b].GetName());
+        });
+        cascadeStats.clear();
+        for(int i : cascadeOrder)
+            cascadeStats.push_back({inputDets[i].GetName() + "/" + matchers[i].GetName(), 0, 0});
+    }
+
+    // detect, match and verify one pair, storing its result for this frame
+    void MatchPair(int i, cv::Mat inpimg, float scale, cv::Rect region, const cv::Mat& guide)
+    {
+        results[i].reset();
+        const DetectResultPtr refer = odometry ? odometry->Current(i) : referDets[i].getResult();
+        if(!refer && !odometry)
+            return;     // no reference yet
+        ExecutionPolicy::SeedThread();
+        if(inputViews.Empty())
+            inputDets[i].DetectAndCompute(inpimg, scale, region);
+        else
+            inputDets[i].DetectAndComputeViews(inpimg, inputViews, scale);
+        frameInputs[i] = inputDets[i].getResult();
+        if(!refer)
+            return;     // first keyframe
+        std::shared_ptr<MatcherResult> match = matchers[i].Match(refer, frameInputs[i], guide, guideRadius);
+        stability[i].Update(frameCount, match->refer->image.size(), *match);
+        match->frame = frameCount;
+        match->unchangedSince = stability[i].Since();
+        results[i] = match;
+    }
+
+    void MatchCascade(cv::Mat inpimg, float scale, cv::Rect region, const cv::Mat& guide)
+    {
+        for(auto& result : results)
+            result.reset();
+        for(size_t stage=0; stage<cascadeOrder.size(); stage++)
+        {
+            const int i = cascadeOrder[stage];
+            MatchPair(i, inpimg, scale, region, guide);
+            if(!results[i])
+                continue;
+            cascadeStats[stage].runs++;
+            if(results[i]->numInliers >= cascadeMinInliers)
+            {
+                cascadeStats[stage].hits++;
+                break;
+            }
+        }
+    }
+
+    // feature type of pair `pair`, empty if there is no such pair
+    std::string PairFeature(size_t pair)
+    {
+        return pair < inputDets.size() ? inputDets[pair].GetName() : std::string();
+    }
+
+    // first pair detecting feature, inputDets.size() if none does
+    size_t FindPair(const std::string& feature)
+    {
+        size_t pair = 0;
+        while(pair < inputDets.size() && inputDets[pair].GetName() != feature)
+            pair++;
+        return pair;
+    }
+
+    void ResetPairState()
+    {
+        stability.clear();
+        stability.resize(matchers.size());
+        results.assign(matchers.size(), MatcherResultPtr());
+        frameInputs.assign(matchers.size(), DetectResultPtr());
+        if(odometry)
+            odometry->Reset();
+        if(tracks)
+            tracks->Reset();
+        ResetCascade();
+    }
+
+    // swap in a configuration finished by Reconfigure, between two frames
+    void ApplyPendingConfig()
+    {
+        std::unique_ptr<PipelineSet> set;
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            set.swap(pending);
+        }
+        if(!set)
+            return;
+
+        referDets.swap(set->referDets);
+        inputDets.swap(set->inputDets);
+        matchers.swap(set->matchers);
+        pairsVersion++;
+        ResetPairState();
+        SetTargetKeypoints(targetKeypoints.start, targetKeypoints.end);
+        if(sketchShortlist > 0)
+            SetSketchShortlist(sketchShortlist);
+        // pairs may have moved; follow them by feature type, off if it is gone
+        if(!trackFeature.empty())
+            trackPair = FindPair(trackFeature);
+        if(!globalFeature.empty())
+            globalPair = FindPair(globalFeature);
+
+        // the reference changed while the set was being built
+        cv::Mat ref;
+        AffineSimulator views;
+        {
+            std::lock_guard<std::mutex> lock(refMutex);
+            if(set->refVersion == refVersion)
+                return;
+            ref = refImage;
+            views = refViews;
+        }
+        if(!ref.empty())
+            DescribeReference(referDets, ref, views);
+    }
 };
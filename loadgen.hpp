@@ -0,0 +1,179 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+
+// LoadGenerator replays frames into a matching target at fixed offered rates.
+// Arrivals are open loop: they follow a Poisson schedule that does not wait
+// for completions, and latency is measured from the scheduled arrival, so
+// queueing delay under overload shows up in the percentiles
+class LoadGenerator
+{
+public:
+    typedef std::function<void(const cv::Mat&)> Target;
+    // creates one target per worker, targets are not shared between threads
+    typedef std::function<Target()> TargetFactory;
+
+    struct Report
+    {
+        double offered;         // requests per second
+        double throughput;      // completed per second
+        size_t completed;
+        double p50, p90, p99, max;  // milliseconds
+    };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<cv::Mat> frames;
+    TargetFactory factory;
+    int concurrency;
+    double seconds;
+
+public:
+    LoadGenerator(const std::vector<cv::Mat> _frames, TargetFactory _factory, int _concurrency=4, double _seconds=10)
+        : frames(_frames), factory(_factory), concurrency(_concurrency), seconds(_seconds)
+    {
+        if(frames.empty())
+            throw std::string("load generator has no frames");
+    }
+
+    // recorded frames from a video file or an image sequence pattern such as img_%04d.png
+    static std::vector<cv::Mat> Recorded(const std::string path, size_t maxFrames=500)
+    {
+        std::vector<cv::Mat> frames;
+        cv::VideoCapture cap(path);
+        cv::Mat frame;
+        while(frames.size() < maxFrames && cap.read(frame))
+            frames.push_back(frame.clone());
+        return frames;
+    }
+
+    // random perspective warps of a reference, as if seen by a moving camera
+    static std::vector<cv::Mat> Synthetic(const cv::Mat& reference, size_t count=50, unsigned seed=1)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> jitter(-0.15f, 0.15f);
+        const float w = float(reference.cols), h = float(reference.rows);
+        std::vector<cv::Point2f> corners = {{0, 0}, {w, 0}, {w, h}, {0, h}};
+        std::vector<cv::Mat> frames;
+        for(size_t i=0; i<count; i++)
+        {
+            std::vector<cv::Point2f> moved;
+            for(const cv::Point2f& c : corners)
+                moved.push_back(c + cv::Point2f(jitter(rng) * w, jitter(rng) * h));
+            cv::Mat warped;
+            cv::warpPerspective(reference, warped, cv::getPerspectiveTransform(corners, moved), reference.size());
+            frames.push_back(warped);
+        }
+        return frames;
+    }
+
+    // one run at the given offered rate
+    Report Run(double rate, unsigned seed=1)
+    {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::pair<size_t, Clock::time_point>> arrivals;
+        std::vector<double> latencies;
+        bool done = false;
+
+        std::vector<Target> targets;
+        for(int i=0; i<concurrency; i++)
+            targets.push_back(factory());
+
+        std::vector<std::thread> workers;
+        for(int i=0; i<concurrency; i++)
+            workers.emplace_back([&, i]
+            {
+                while(true)
+                {
+                    std::pair<size_t, Clock::time_point> arrival;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ready.wait(lock, [&] { return done || !arrivals.empty(); });
+                        if(arrivals.empty())
+                            return;
+                        arrival = arrivals.front();
+                        arrivals.pop_front();
+                    }
+                    targets[i](frames[arrival.first % frames.size()]);
+                    const double ms = std::chrono::duration<double, std::milli>(Clock::now() - arrival.second).count();
+                    std::lock_guard<std::mutex> lock(mutex);
+                    latencies.push_back(ms);
+                }
+            });
+
+        // Poisson arrivals: exponential gaps on an absolute schedule
+        std::mt19937 rng(seed);
+        std::exponential_distribution<double> gap(rate);
+        const Clock::time_point start = Clock::now();
+        const Clock::time_point end = start + std::chrono::microseconds(int64_t(seconds * 1e6));
+        Clock::time_point next = start;
+        for(size_t n=0; ; n++)
+        {
+            next += std::chrono::microseconds(int64_t(gap(rng) * 1e6));
+            if(next >= end)
+                break;
+            std::this_thread::sleep_until(next);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                arrivals.emplace_back(n, next);
+            }
+            ready.notify_one();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        ready.notify_all();
+        for(std::thread& worker : workers)
+            worker.join();
+        const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        Report report = {rate, latencies.size() / elapsed, latencies.size(), 0, 0, 0, 0};
+        if(!latencies.empty())
+        {
+            std::sort(latencies.begin(), latencies.end());
+            report.p50 = Percentile(latencies, 0.50);
+            report.p90 = Percentile(latencies, 0.90);
+            report.p99 = Percentile(latencies, 0.99);
+            report.max = latencies.back();
+        }
+        return report;
+    }
+
+    // latency versus offered load, one line per rate
+    std::vector<Report> Sweep(const std::vector<double>& rates)
+    {
+        std::vector<Report> reports;
+        std::cout << "concurrency " << concurrency << ", " << seconds << " s per rate, " << frames.size() << " frames"
+                  << std::endl << " offered/s  done/s  completed   p50 ms   p90 ms   p99 ms   max ms" << std::endl;
+        for(double rate : rates)
+        {
+            reports.push_back(Run(rate));
+            const Report& r = reports.back();
+            std::cout << std::fixed << std::setprecision(1) << std::setw(10) << r.offered << std::setw(8) << r.throughput
+                      << std::setw(11) << r.completed << std::setw(9) << r.p50 << std::setw(9) << r.p90
+                      << std::setw(9) << r.p99 << std::setw(9) << r.max << std::endl;
+        }
+        return reports;
+    }
+
+    static double Percentile(const std::vector<double>& sorted, double q)
+    {
+        const size_t i = std::min(sorted.size() - 1, size_t(q * sorted.size()));
+        return sorted[i];
+    }
+};
@@ -0,0 +1,236 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include <cmath>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include "feature.hpp"
+#include "executor.hpp"
+
+
+// a verified revisit: the new keyframe shows the place of an earlier one
+struct LoopCandidate
+{
+    int keyframe;           // index of the earlier keyframe
+    long frame;             // its frame number
+    double score;           // bag-of-words similarity
+    int inliers;
+    cv::Mat homography;     // earlier keyframe -> new keyframe
+};
+
+
+// LoopClosureDetector recognizes keyframes that revisit an earlier place.
+// Keyframes are described as tf-idf weighted visual words and indexed in an
+// inverted file over a vocabulary trained once on the first keyframes, on
+// the background lane of PriorityExecutor; keyframes are only collected
+// until it is ready. Every word keeps the maxPostings keyframes that weigh
+// it most, whatever their age, so a query reads a bounded number of
+// postings however large the map grows. Only keypoints and descriptors of
+// a keyframe are kept, not its image. A candidate must come back
+// consistently on several consecutive keyframes and then pass Matcher +
+// RANSAC before a loop is reported
+class LoopClosureDetector
+{
+    Matcher matcher;
+    int vocabularySize;
+    int trainKeyframes;
+    size_t maxPostings;     // per word
+    int minGap;             // keyframes too recent to count as a revisit
+    int consistency;        // consecutive agreeing queries required
+    int temporalWindow;     // max keyframe distance between agreeing candidates
+    int minInliers;
+
+    // vocabulary handed over by the background training task
+    struct Vocabulary
+    {
+        std::mutex mutex;
+        cv::Mat centers;
+        bool running = false;
+    };
+    std::shared_ptr<Vocabulary> vocabulary;
+    cv::Ptr<cv::DescriptorMatcher> quantizer;
+    bool trained;
+    std::vector<DetectResultPtr> keyframes;     // keypoints and descriptors only
+    std::vector<long> frames;
+    std::vector<std::vector<std::pair<int, float>>> postings;   // word -> (keyframe, weight)
+    std::vector<int> documentFrequency;
+    std::deque<int> recentBest;
+
+public:
+    LoopClosureDetector(const std::string feature, const std::string matcherName="bf", int _vocabularySize=1000,
+                        int _trainKeyframes=20, int _maxPostings=100, int _minGap=30, int _consistency=3,
+                        int _temporalWindow=2, int _minInliers=25)
+        : matcher(Matcher::Factory(matcherName, feature)), vocabularySize(_vocabularySize),
+          trainKeyframes(_trainKeyframes), maxPostings(size_t(std::max(1, _maxPostings))), minGap(_minGap),
+          consistency(_consistency), temporalWindow(_temporalWindow), minInliers(_minInliers),
+          vocabulary(std::make_shared<Vocabulary>()), trained(false) {}
+
+    size_t NumKeyframes() const { return keyframes.size(); }
+
+    // index a new keyframe; returns true and fills loop if it closes a loop
+    bool AddKeyframe(long frame, const DetectResultPtr& features, LoopCandidate& loop)
+    {
+        const int id = int(keyframes.size());
+        std::shared_ptr<DetectResult> compact = std::make_shared<DetectResult>();
+        compact->name = features->name;
+        compact->keypts = features->keypts;
+        compact->descriptors = features->descriptors.clone();
+        keyframes.push_back(compact);
+        frames.push_back(frame);
+        if(!trained)
+        {
+            if(!TakeVocabulary())
+                return false;
+            for(int i=0; i<id; i++)
+                Insert(i, Weights(keyframes[i]->descriptors));
+        }
+
+        const std::unordered_map<int, float> weights = Weights(features->descriptors);
+        double score = 0;
+        const int best = BestMatch(weights, id, score);
+        Insert(id, weights);
+
+        recentBest.push_back(best);
+        if(int(recentBest.size()) > consistency)
+            recentBest.pop_front();
+        if(best < 0 || !Consistent())
+            return false;
+
+        std::shared_ptr<MatcherResult> match = matcher.Match(keyframes[best], compact);
+        if(match->homography.empty() || match->numInliers < minInliers)
+            return false;
+        loop = {best, frames[best], score, match->numInliers, match->homography.clone()};
+        recentBest.clear();
+        return true;
+    }
+
+private:
+    // installs the vocabulary once the background task has it; starts that
+    // task when enough keyframes are collected. false until installed
+    bool TakeVocabulary()
+    {
+        cv::Mat centers;
+        {
+            std::lock_guard<std::mutex> lock(vocabulary->mutex);
+            centers = vocabulary->centers;
+            if(centers.empty())
+            {
+                if(!vocabulary->running && int(keyframes.size()) >= trainKeyframes)
+                {
+                    vocabulary->running = true;
+                    StartTraining();
+                }
+                return false;
+            }
+        }
+        quantizer = cv::BFMatcher::create(cv::NORM_L2);
+        quantizer->add(std::vector<cv::Mat>{centers});
+        quantizer->train();
+        postings.assign(centers.rows, std::vector<std::pair<int, float>>());
+        documentFrequency.assign(centers.rows, 0);
+        trained = true;
+        return true;
+    }
+
+    // cluster the words on the background lane, off the live loop
+    void StartTraining()
+    {
+        std::shared_ptr<Vocabulary> target = vocabulary;
+        std::vector<DetectResultPtr> training = keyframes;
+        const int words = vocabularySize;
+        PriorityExecutor::Instance().Submit([target, training, words]
+        {
+            cv::Mat centers;
+            try
+            {
+                cv::Mat samples;
+                for(const DetectResultPtr& keyframe : training)
+                    samples.push_back(VladEncoder::ToFloat(keyframe->descriptors));
+                cv::Mat labels;
+                cv::kmeans(samples, std::min(words, samples.rows), labels,
+                           cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 15, 1e-3),
+                           1, cv::KMEANS_PP_CENTERS, centers);
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "loop closure vocabulary failed: " << e.what() << std::endl;
+            }
+            // on failure the next keyframe starts another attempt
+            std::lock_guard<std::mutex> lock(target->mutex);
+            target->centers = centers;
+            target->running = false;
+        });
+    }
+
+    // L2 normalized tf-idf vector over the words of the descriptors
+    std::unordered_map<int, float> Weights(const cv::Mat& descriptors) const
+    {
+        std::unordered_map<int, float> weights;
+        if(descriptors.empty())
+            return weights;
+        std::vector<cv::DMatch> words;
+        quantizer->match(VladEncoder::ToFloat(descriptors), words);
+        for(const cv::DMatch& word : words)
+            weights[word.trainIdx] += 1.f / words.size();
+
+        const float numDocs = float(keyframes.size());
+        float norm = 0;
+        for(auto& weight : weights)
+        {
+            weight.second *= std::log((numDocs + 1) / (documentFrequency[weight.first] + 1));
+            norm += weight.second * weight.second;
+        }
+        norm = std::sqrt(norm);
+        for(auto& weight : weights)
+            weight.second = norm > 0 ? weight.second / norm : 0;
+        return weights;
+    }
+
+    // postings stay sorted by weight, heaviest first, and keep maxPostings
+    void Insert(int id, const std::unordered_map<int, float>& weights)
+    {
+        auto heavier = [](const std::pair<int, float>& a, const std::pair<int, float>& b) { return a.second > b.second; };
+        for(const auto& weight : weights)
+        {
+            std::vector<std::pair<int, float>>& list = postings[weight.first];
+            documentFrequency[weight.first]++;
+            const std::pair<int, float> posting(id, weight.second);
+            if(list.size() >= maxPostings && !heavier(posting, list.back()))
+                continue;
+            list.insert(std::upper_bound(list.begin(), list.end(), posting, heavier), posting);
+            if(list.size() > maxPostings)
+                list.pop_back();
+        }
+    }
+
+    // highest scoring keyframe at least minGap keyframes older than id, -1 if none
+    int BestMatch(const std::unordered_map<int, float>& weights, int id, double& bestScore) const
+    {
+        std::unordered_map<int, double> scores;
+        for(const auto& weight : weights)
+            for(const auto& posting : postings[weight.first])
+                if(posting.first <= id - minGap)
+                    scores[posting.first] += weight.second * posting.second;
+        int best = -1;
+        bestScore = 0;
+        for(const auto& score : scores)
+            if(score.second > bestScore || (score.second == bestScore && score.first < best))
+            {
+                best = score.first;
+                bestScore = score.second;
+            }
+        return best;
+    }
+
+    // the last `consistency` queries all found a candidate in the same neighbourhood
+    bool Consistent() const
+    {
+        if(int(recentBest.size()) < consistency)
+            return false;
+        for(size_t i=1; i<recentBest.size(); i++)
+            if(recentBest[i-1] < 0 || std::abs(recentBest[i] - recentBest[i-1]) > temporalWindow)
+                return false;
+        return true;
+    }
+};
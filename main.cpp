@@ -1,10 +1,278 @@
 #include <opencv2/opencv.hpp>
 #include <iostream>
+#include <sstream>
 #include "feature.hpp"
+#include "display.hpp"
+#include "config_watcher.hpp"
+#include "server.hpp"
+#include "loadgen.hpp"
+#include "admission.hpp"
+#include "shard.hpp"
+#include "minhash.hpp"
+#include "loop_closure.hpp"
+#include <thread>
+#include <atomic>
 
 
-int main()
+int main(int argc, char** argv)
 {
+    // cvfeature --check-determinism [image] : deterministic mode must give the same keypoints
+    // and matches on one thread and on all of them; exits nonzero otherwise.
+    // without an image a synthetic textured scene is used
+    if(argc >= 2 && std::string(argv[1]) == "--check-determinism")
+    {
+        cv::Mat image;
+        if(argc > 2)
+        {
+            image = cv::imread(argv[2]);
+            if(image.empty())
+            {
+                std::cout<<"cannot read "<<argv[2]<<std::endl;
+                return -1;
+            }
+        }
+        else
+        {
+            image = cv::Mat(480, 640, CV_8UC3, cv::Scalar::all(0));
+            cv::RNG rng(1);
+            for(int i=0; i<300; i++)
+            {
+                const cv::Point center(rng.uniform(0, image.cols), rng.uniform(0, image.rows));
+                const cv::Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+                if(i % 2)
+                    cv::circle(image, center, rng.uniform(3, 30), color, -1);
+                else
+                    cv::rectangle(image, center, center + cv::Point(rng.uniform(5, 60), rng.uniform(5, 60)), color, -1);
+            }
+        }
+
+        // a few rotated and scaled views, so threshold adaptation runs too
+        std::vector<cv::Mat> frames;
+        for(int i=1; i<=3; i++)
+        {
+            cv::Mat frame;
+            const cv::Point2f center(image.cols / 2.f, image.rows / 2.f);
+            cv::warpAffine(image, frame, cv::getRotationMatrix2D(center, 8.0 * i, 1.0 - 0.05 * i), image.size());
+            frames.push_back(frame);
+        }
+
+        auto digest = [&](int threads)
+        {
+            MatchHandler handler({"sift","surf", "orb"}, {"bf","flann", "flann"});
+            handler.SetExecutionPolicy({threads, true, 12345u});
+            handler.SetTargetKeypoints(300, 800);
+            handler.SetRefImage(image.clone());
+            for(const cv::Mat& frame : frames)
+                handler.MatchImage(frame.clone());
+            return handler.ResultDigest();
+        };
+        const int threads = std::max(2, int(std::thread::hardware_concurrency()));
+        const uint64_t single = digest(1);
+        const uint64_t multi = digest(threads);
+        std::cout << "digest 1 thread: " << std::hex << single << ", " << std::dec << threads << " threads: "
+                  << std::hex << multi << std::dec << std::endl;
+        if(single != multi)
+        {
+            std::cout << "results depend on the thread count" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // worker process of ShardedReferenceDB
+    if(argc == 5 && std::string(argv[1]) == "--shard-worker")
+        return ShardedReferenceDB::RunWorker(std::stoi(argv[2]), argv[3], argv[4]);
+
+    // cvfeature --shards <count> <query image> <reference image>... : ORB votes per reference
+    if(argc >= 5 && std::string(argv[1]) == "--shards")
+    {
+        try
+        {
+            Detector orb = Detector::Factory("orb");
+            ShardedReferenceDB db(std::stoi(argv[2]), "orb", "bf");
+            for(int i=4; i<argc; i++)
+            {
+                cv::Mat image = cv::imread(argv[i], cv::IMREAD_GRAYSCALE);
+                if(image.empty())
+                    throw std::string("cannot read ") + argv[i];
+                orb.DetectAndCompute(image);
+                db.Add(i - 4, orb.getResult()->descriptors);
+            }
+            db.Rebalance();
+            for(size_t i=0; i<db.NumShards(); i++)
+                std::cout << "shard " << i << ": " << db.ShardRows(int(i)) << " descriptors" << std::endl;
+
+            cv::Mat query = cv::imread(argv[3], cv::IMREAD_GRAYSCALE);
+            if(query.empty())
+                throw std::string("cannot read ") + argv[3];
+            orb.DetectAndCompute(query);
+            std::vector<int> votes(argc - 4, 0);
+            for(const auto& neighbours : db.Query(orb.getResult()->descriptors, 2))
+                if(neighbours.size() == 2 && neighbours[0].distance < 0.8f * neighbours[1].distance)
+                    votes[neighbours[0].imgIdx]++;
+            for(int i=4; i<argc; i++)
+                std::cout << argv[i] << ": " << votes[i - 4] << " votes" << std::endl;
+        }
+        catch(const std::string& e)
+        {
+            std::cout << e << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // cvfeature --retrieve <query image> <reference image>... : closest references by VLAD + PQ
+    if(argc >= 4 && std::string(argv[1]) == "--retrieve")
+    {
+        try
+        {
+            Detector sift = Detector::Factory("sift");
+            std::vector<cv::Mat> references;
+            for(int i=3; i<argc; i++)
+            {
+                cv::Mat image = cv::imread(argv[i], cv::IMREAD_GRAYSCALE);
+                if(image.empty())
+                    throw std::string("cannot read ") + argv[i];
+                sift.DetectAndCompute(image);
+                references.push_back(sift.getResult()->descriptors.clone());
+            }
+            GlobalIndex index;
+            index.Train(references);
+            for(size_t i=0; i<references.size(); i++)
+                index.Add(int(i), references[i]);
+
+            cv::Mat query = cv::imread(argv[2], cv::IMREAD_GRAYSCALE);
+            if(query.empty())
+                throw std::string("cannot read ") + argv[2];
+            sift.DetectAndCompute(query);
+            const int64 start = cv::getTickCount();
+            std::vector<GlobalIndex::Candidate> candidates = index.Search(sift.getResult()->descriptors, 5);
+            std::cout << "search: " << (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency() << " ms" << std::endl;
+            for(const GlobalIndex::Candidate& candidate : candidates)
+                std::cout << argv[candidate.id + 3] << ": " << candidate.distance << std::endl;
+        }
+        catch(const std::string& e)
+        {
+            std::cout << e << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // cvfeature --dedup <video | image pattern> [min similarity] : near-duplicate frames of a recording
+    if(argc >= 3 && std::string(argv[1]) == "--dedup")
+    {
+        const double minSimilarity = argc > 3 ? std::stod(argv[3]) : 0.6;
+        cv::VideoCapture cap(argv[2]);
+        Detector orb = Detector::Factory("orb");
+        NearDuplicateIndex index;
+        cv::Mat frame;
+        long duplicates = 0;
+        for(int id=0; cap.read(frame); id++)
+        {
+            orb.DetectAndCompute(frame);
+            const std::vector<uint64_t> signature = MinHashSignature::Compute(
+                MinHashSignature::Words(orb.getResult()->descriptors), index.NumHashes());
+            std::vector<NearDuplicateIndex::Neighbour> similar = index.Query(signature, minSimilarity);
+            if(!similar.empty())
+            {
+                duplicates++;
+                std::cout << "frame " << id << " ~ frame " << similar.front().id
+                          << " (" << similar.front().similarity << ")" << std::endl;
+            }
+            index.Add(id, signature);
+        }
+        std::cout << duplicates << " of " << index.Size() << " frames are near duplicates" << std::endl;
+        return 0;
+    }
+
+    // cvfeature --bench-asift <image> : thread scaling of affine simulation
+    if(argc == 3 && std::string(argv[1]) == "--bench-asift")
+    {
+        cv::Mat image = cv::imread(argv[2], cv::IMREAD_GRAYSCALE);
+        if(image.empty())
+        {
+            std::cout<<"cannot read "<<argv[2]<<std::endl;
+            return -1;
+        }
+        AffineSimulator::BenchmarkThreads(AffineSimulator::Asift(), cv::SIFT::create(), image);
+        return 0;
+    }
+
+    // cvfeature --server <socket> <reference image> [max batch] [max wait ms]
+    if(argc >= 4 && std::string(argv[1]) == "--server")
+    {
+        cv::Mat refimg = cv::imread(argv[3]);
+        if(refimg.empty())
+        {
+            std::cout<<"cannot read "<<argv[3]<<std::endl;
+            return -1;
+        }
+        const size_t maxBatch = argc > 4 ? std::stoul(argv[4]) : 16;
+        const int maxWaitMs = argc > 5 ? std::stoi(argv[5]) : 5;
+        try
+        {
+            MatchServer server(argv[2], {"sift","surf", "orb"}, {"bf","flann", "flann"}, refimg, maxBatch, maxWaitMs);
+            server.Run();
+        }
+        catch(const std::string& e)
+        {
+            std::cout << e << std::endl;
+            return -1;
+        }
+        catch(const std::exception& e)
+        {
+            std::cout << e.what() << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // cvfeature --loadgen <video | reference image> <inproc | socket> <rate,rate,...> [concurrency] [seconds]
+    // a still image is replayed as synthetic warps of itself
+    if(argc >= 5 && std::string(argv[1]) == "--loadgen")
+    {
+        std::vector<cv::Mat> frames;
+        cv::Mat still = cv::imread(argv[2]);
+        if(!still.empty())
+            frames = LoadGenerator::Synthetic(still);
+        else
+            frames = LoadGenerator::Recorded(argv[2]);
+        if(frames.empty())
+        {
+            std::cout<<"cannot read "<<argv[2]<<std::endl;
+            return -1;
+        }
+
+        std::vector<double> rates;
+        std::stringstream list(argv[4]);
+        for(std::string rate; std::getline(list, rate, ',');)
+            rates.push_back(std::stod(rate));
+
+        const std::string target = argv[3];
+        LoadGenerator::TargetFactory factory;
+        if(target == "inproc")
+        {
+            const cv::Mat refimg = frames.front();
+            factory = [refimg]
+            {
+                std::shared_ptr<MatchHandler> handler(new MatchHandler({"sift","surf", "orb"}, {"bf","flann", "flann"}));
+                handler->SetRefImage(refimg.clone());
+                return [handler](const cv::Mat& frame) { handler->MatchImage(frame); };
+            };
+        }
+        else
+            factory = [target]
+            {
+                std::shared_ptr<MatchClient> client(new MatchClient(target));
+                return [client](const cv::Mat& frame) { client->MatchImage(frame); };
+            };
+
+        LoadGenerator loadgen(frames, factory, argc > 5 ? std::stoi(argv[5]) : 4, argc > 6 ? std::stod(argv[6]) : 10);
+        loadgen.Sweep(rates);
+        return 0;
+    }
+
     std::cout << "Press 'r' to change reference frame," << std::endl
             << "'u' to increase min inlier ratio," << std::endl
             << "'d' to decrease min inlier ratio," << std::endl
@@ -19,27 +287,59 @@ int main()
     cap >> frame;
 
     MatchHandler matcher({"sift","surf", "orb"}, {"bf","flann", "flann"});
+    matcher.SetTargetFps(30);
+    matcher.SetTargetKeypoints(300, 800);
 
     matcher.SetRefImage(frame.clone());
-    while(1)
+
+    // cvfeature --odometry : track camera motion against rolling keyframes
+    // and report revisited places among them
+    const bool odometry = argc == 2 && std::string(argv[1]) == "--odometry";
+    if(odometry)
+        matcher.SetOdometry(true);
+    const std::string loopFeature = "orb";
+    LoopClosureDetector loops(loopFeature);
+
+    // cvfeature --control <file> : detector/matcher pairs can be changed at runtime
+    std::unique_ptr<ConfigWatcher> watcher;
+    if(argc == 3 && std::string(argv[1]) == "--control")
+        watcher.reset(new ConfigWatcher(argv[2], matcher));
+
+    // capture on its own thread so a slow frame never stalls the camera;
+    // the backlog is bounded and drives the degrade level
+    AdmissionQueue admission(4, ShedPolicy::DropOldest);
+    std::atomic<bool> capturing(true);
+    std::thread capture([&]
     {
-        cap >> frame;
-        matcher.MatchImage(frame);
-        int key = cv::waitKey(10);
-        if(key==int('f') || key==int('F'))
-        {
-            std::cout << "change reference image" << std::endl;
-            matcher.SetRefImage(frame.clone());
-        }
-        else if(key==int('u') || key==int('U'))
-            matcher.ChangeAcceptRatio(0.1f);
-        else if(key==int('d') || key==int('D'))
-            matcher.ChangeAcceptRatio(-0.1f);
-        else if(key==int('q') || key==int('Q'))
+        cv::Mat captured;
+        while(capturing && cap.read(captured))
+            admission.Push(captured.clone());
+        admission.Close();
+    });
+
+    Display display("matches", matcher);
+    int level;
+    while(admission.Pop(frame, level))
+    {
+        if(!matcher.ProcessCommands(frame))
             break;
-        cv::Mat result = matcher.DrawMatchResult();
-        cv::imshow("matches", result);
-        cv::waitKey(10);
+        matcher.SetDegradeLevel(level);
+        matcher.MatchImage(frame);
+        display.Show(matcher.Results());
+
+        const Keyframe* keyframe = odometry ? &matcher.Odometry()->Keyframes().back() : nullptr;
+        DetectResultPtr loopFeatures;
+        if(keyframe && keyframe->frame == matcher.FrameIndex())
+            for(const DetectResultPtr& features : keyframe->features)
+                if(features && features->name == loopFeature)
+                    loopFeatures = features;
+        LoopCandidate loop;
+        if(loopFeatures && loops.AddKeyframe(keyframe->frame, loopFeatures, loop))
+            std::cout << "loop closed: frame " << keyframe->frame << " revisits frame " << loop.frame
+                      << " (" << loop.inliers << " inliers)" << std::endl;
     }
+    capturing = false;
+    capture.join();
+    admission.PrintStats();
     return 0;
 }
@@ -0,0 +1,156 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+#include <opencv2/opencv.hpp>
+
+
+// MinHashSignature summarizes the set of visual words of one frame so that
+// the fraction of equal entries between two signatures estimates the
+// Jaccard similarity of their word sets. ORB descriptors are quantized to
+// words by sampling fixed bit positions, which needs no training and keeps
+// a descriptor's word under small bit flips outside the sampled bits
+class MinHashSignature
+{
+public:
+    static const int WordBits = 20;
+    static const int OrbBits = 256;
+
+    // word of every ORB descriptor row, duplicates removed
+    static std::vector<uint32_t> Words(const cv::Mat& orbDesc)
+    {
+        std::vector<uint32_t> words;
+        if(orbDesc.empty())
+            return words;   // e.g. a black frame
+        CV_Assert(orbDesc.type() == CV_8U && orbDesc.cols * 8 == OrbBits);
+        const std::vector<int>& bits = SampledBits();
+        for(int r=0; r<orbDesc.rows; r++)
+        {
+            const uchar* d = orbDesc.ptr<uchar>(r);
+            uint32_t word = 0;
+            for(int b : bits)
+                word = (word << 1) | ((d[b >> 3] >> (b & 7)) & 1);
+            words.push_back(word);
+        }
+        std::sort(words.begin(), words.end());
+        words.erase(std::unique(words.begin(), words.end()), words.end());
+        return words;
+    }
+
+    // numHashes minimum hash values over the word set
+    static std::vector<uint64_t> Compute(const std::vector<uint32_t>& words, int numHashes=64)
+    {
+        std::vector<uint64_t> signature(numHashes, UINT64_MAX);
+        for(uint32_t word : words)
+            for(int i=0; i<numHashes; i++)
+                signature[i] = std::min(signature[i], Mix(word ^ (uint64_t(i) * 0x9e3779b97f4a7c15ull)));
+        return signature;
+    }
+
+    static double Similarity(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b)
+    {
+        int equal = 0;
+        for(size_t i=0; i<a.size(); i++)
+            equal += a[i] == b[i];
+        return a.empty() ? 0 : double(equal) / a.size();
+    }
+
+    // splitmix64 finalizer
+    static uint64_t Mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+private:
+    static const std::vector<int>& SampledBits()
+    {
+        static const std::vector<int> bits = []
+        {
+            std::vector<int> all(OrbBits);
+            std::iota(all.begin(), all.end(), 0);
+            cv::RNG rng(0x5eed);
+            for(int i=0; i<WordBits; i++)
+                std::swap(all[i], all[i + rng.uniform(0, OrbBits - i)]);
+            all.resize(WordBits);
+            return all;
+        }();
+        return bits;
+    }
+};
+
+
+// NearDuplicateIndex answers "frames similar to this one" without comparing
+// against every frame: signatures are cut into bands, and frames sharing
+// any whole band land in the same bucket. with b bands of r rows a pair of
+// similarity s becomes a candidate with probability 1 - (1 - s^r)^b;
+// candidates are then checked on the full signature
+class NearDuplicateIndex
+{
+    int bands;
+    int rows;
+    std::vector<std::unordered_map<uint64_t, std::vector<int>>> buckets;
+    std::vector<std::vector<uint64_t>> signatures;
+    std::vector<int> ids;
+
+public:
+    struct Neighbour
+    {
+        int id;
+        double similarity;
+    };
+
+    NearDuplicateIndex(int _bands=16, int _rows=4)
+        : bands(_bands), rows(_rows), buckets(_bands) {}
+
+    int NumHashes() const { return bands * rows; }
+    size_t Size() const { return ids.size(); }
+
+    void Add(int id, const std::vector<uint64_t>& signature)
+    {
+        const int index = int(ids.size());
+        for(int b=0; b<bands; b++)
+            buckets[b][BandKey(signature, b)].push_back(index);
+        signatures.push_back(signature);
+        ids.push_back(id);
+    }
+
+    // indexed frames with estimated similarity >= minSimilarity, most similar first
+    std::vector<Neighbour> Query(const std::vector<uint64_t>& signature, double minSimilarity=0.5) const
+    {
+        std::unordered_set<int> seen;
+        std::vector<Neighbour> found;
+        for(int b=0; b<bands; b++)
+        {
+            auto bucket = buckets[b].find(BandKey(signature, b));
+            if(bucket == buckets[b].end())
+                continue;
+            for(int index : bucket->second)
+            {
+                if(!seen.insert(index).second)
+                    continue;
+                const double similarity = MinHashSignature::Similarity(signature, signatures[index]);
+                if(similarity >= minSimilarity)
+                    found.push_back({ids[index], similarity});
+            }
+        }
+        std::sort(found.begin(), found.end(), [](const Neighbour& a, const Neighbour& b)
+        {
+            return a.similarity > b.similarity || (a.similarity == b.similarity && a.id < b.id);
+        });
+        return found;
+    }
+
+private:
+    uint64_t BandKey(const std::vector<uint64_t>& signature, int band) const
+    {
+        uint64_t key = uint64_t(band);
+        for(int r=0; r<rows; r++)
+            key = MinHashSignature::Mix(key ^ signature[band * rows + r]);
+        return key;
+    }
+};
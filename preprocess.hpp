@@ -0,0 +1,236 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "executor.hpp"
+
+
+// Preprocessor turns a camera frame into the detection-ready grayscale image
+// in one pass over the source: color conversion, lens undistortion, resizing
+// and a 3x3 binomial pre-blur are fused per output row, driven by sampling
+// tables precomputed once per input size: separable per-column and per-row
+// tables for plain resizing, a dense remap LUT only when undistorting.
+// Optionally a half-scale image is produced from the same rows.
+class Preprocessor
+{
+    cv::Mat cameraMatrix;
+    cv::Mat distCoeffs;
+    float scale;
+    bool blur;
+    bool half;
+
+    // tables for the current input size: source pixels of the bilinear 2x2
+    // neighbourhood, clamped to the frame, and weights in 1/256 units
+    cv::Size inputSize;
+    cv::Size outputSize;
+    // per output column and row, without undistortion
+    std::vector<int32_t> colX0, colX1, rowY0, rowY1;
+    std::vector<uint8_t> colFrac, rowFrac;
+    // per output pixel (top-left neighbour), with undistortion
+    std::vector<int32_t> srcX, srcY;
+    std::vector<uint8_t> fracX, fracY;
+
+public:
+    Preprocessor() : scale(1.f), blur(false), half(false) {}
+
+    // scale resizes the output, blur applies a 3x3 binomial filter,
+    // half also produces a half-resolution image.
+    // cameraMatrix/distCoeffs enable undistortion when given
+    Preprocessor(float _scale, bool _blur, bool _half=false,
+                 cv::Mat _cameraMatrix=cv::Mat(), cv::Mat _distCoeffs=cv::Mat())
+        : cameraMatrix(_cameraMatrix), distCoeffs(_distCoeffs), scale(_scale), blur(_blur), half(_half) {}
+
+    bool Enabled() const
+    {
+        return scale != 1.f || blur || half || !cameraMatrix.empty();
+    }
+
+    // 8-bit gray or BGR frame in, 8-bit gray out (halfOut filled if enabled)
+    cv::Mat Run(const cv::Mat& frame, cv::Mat* halfOut=nullptr)
+    {
+        CV_Assert(frame.depth() == CV_8U && (frame.channels() == 1 || frame.channels() == 3));
+        if(frame.size() != inputSize)
+            BuildLut(frame.size());
+
+        cv::Mat gray(outputSize, CV_8UC1);
+        cv::Mat halfImg;
+        if(half)
+            halfImg.create(outputSize.height / 2, outputSize.width / 2, CV_8UC1);
+
+        // stripes of even height so that every half-scale row is owned by one stripe
+        const int stripe = 32;
+        const int numStripes = (outputSize.height + stripe - 1) / stripe;
+        auto runStripes = [&](const cv::Range& range)
+        {
+            std::vector<uint8_t> rows(3 * outputSize.width);
+            std::vector<uint16_t> vsum(outputSize.width);
+            for(int s=range.start; s<range.end; s++)
+            {
+                const int y0 = s * stripe;
+                const int y1 = std::min(outputSize.height, y0 + stripe);
+                ProcessRows(frame, gray, y0, y1, rows, vsum);
+                if(half)
+                    Halve(gray, halfImg, y0, y1);
+            }
+        };
+        // background enrollment stays off OpenCV's pool
+        if(PriorityExecutor::OnBackgroundLane())
+            runStripes(cv::Range(0, numStripes));
+        else
+            cv::parallel_for_(cv::Range(0, numStripes), runStripes);
+
+        if(halfOut)
+            *halfOut = halfImg;
+        return gray;
+    }
+
+private:
+    void BuildLut(cv::Size size)
+    {
+        inputSize = size;
+        outputSize = cv::Size(std::max(1, int(size.width * scale + 0.5f)),
+                              std::max(1, int(size.height * scale + 0.5f)));
+
+        if(cameraMatrix.empty())
+        {
+            srcX.clear(); srcY.clear(); fracX.clear(); fracY.clear();
+            const float sx = float(size.width) / outputSize.width;
+            const float sy = float(size.height) / outputSize.height;
+            colX0.resize(outputSize.width);
+            colX1.resize(outputSize.width);
+            colFrac.resize(outputSize.width);
+            for(int x=0; x<outputSize.width; x++)
+                Split((x + 0.5f) * sx - 0.5f, size.width, colX0[x], colX1[x], colFrac[x]);
+            rowY0.resize(outputSize.height);
+            rowY1.resize(outputSize.height);
+            rowFrac.resize(outputSize.height);
+            for(int y=0; y<outputSize.height; y++)
+                Split((y + 0.5f) * sy - 0.5f, size.height, rowY0[y], rowY1[y], rowFrac[y]);
+            return;
+        }
+
+        // source coordinates for every output pixel
+        cv::Mat mapX, mapY;
+        cv::Mat newCamera = cameraMatrix.clone();
+        newCamera.convertTo(newCamera, CV_64F);
+        newCamera.at<double>(0,0) *= scale;
+        newCamera.at<double>(1,1) *= scale;
+        newCamera.at<double>(0,2) *= scale;
+        newCamera.at<double>(1,2) *= scale;
+        cv::initUndistortRectifyMap(cameraMatrix, distCoeffs, cv::Mat(), newCamera,
+                                    outputSize, CV_32FC1, mapX, mapY);
+
+        colX0.clear(); colX1.clear(); colFrac.clear();
+        rowY0.clear(); rowY1.clear(); rowFrac.clear();
+        const size_t total = size_t(outputSize.area());
+        srcX.resize(total);
+        srcY.resize(total);
+        fracX.resize(total);
+        fracY.resize(total);
+        for(int y=0; y<outputSize.height; y++)
+            for(int x=0; x<outputSize.width; x++)
+            {
+                const size_t i = size_t(y) * outputSize.width + x;
+                int32_t next;
+                Split(mapX.at<float>(y, x), size.width, srcX[i], next, fracX[i]);
+                Split(mapY.at<float>(y, x), size.height, srcY[i], next, fracY[i]);
+            }
+    }
+
+    // clamp a source coordinate into [0, size-1]; the second neighbour
+    // stays inside too, so width or height 1 never reads past the frame
+    static void Split(float f, int size, int32_t& i0, int32_t& i1, uint8_t& frac)
+    {
+        f = std::max(0.f, std::min(f, float(size - 1)));
+        i0 = int32_t(f);
+        i1 = std::min(i0 + 1, size - 1);
+        frac = uint8_t((f - i0) * 256.f);
+    }
+
+    // bilinear sample of the gray value, BGR weights as in cv::cvtColor (x256)
+    static inline int Gray(const uint8_t* p, int channels)
+    {
+        return channels == 1 ? p[0] * 256 : p[0] * 29 + p[1] * 150 + p[2] * 77;
+    }
+
+    void SampleRow(const cv::Mat& frame, int y, uint8_t* out) const
+    {
+        const int channels = frame.channels();
+        const size_t step = frame.step;
+        const uint8_t* base = frame.data;
+        if(srcX.empty())
+        {
+            const uint8_t* r0 = base + rowY0[y] * step;
+            const uint8_t* r1 = base + rowY1[y] * step;
+            const int wy = rowFrac[y];
+            for(int x=0; x<outputSize.width; x++)
+            {
+                const int a = colX0[x] * channels, b = colX1[x] * channels;
+                const int wx = colFrac[x];
+                const int top = Gray(r0 + a, channels) * (256 - wx) + Gray(r0 + b, channels) * wx;
+                const int bottom = Gray(r1 + a, channels) * (256 - wx) + Gray(r1 + b, channels) * wx;
+                out[x] = uint8_t((int64_t(top) * (256 - wy) + int64_t(bottom) * wy + (1 << 23)) >> 24);
+            }
+            return;
+        }
+        const size_t offset = size_t(y) * outputSize.width;
+        for(int x=0; x<outputSize.width; x++)
+        {
+            const size_t i = offset + x;
+            const uint8_t* p = base + srcY[i] * step + srcX[i] * channels;
+            const int dx = srcX[i] + 1 < inputSize.width ? channels : 0;
+            const size_t dy = srcY[i] + 1 < inputSize.height ? step : 0;
+            const int wx = fracX[i], wy = fracY[i];
+            const int top = Gray(p, channels) * (256 - wx) + Gray(p + dx, channels) * wx;
+            const int bottom = Gray(p + dy, channels) * (256 - wx) + Gray(p + dy + dx, channels) * wx;
+            out[x] = uint8_t((int64_t(top) * (256 - wy) + int64_t(bottom) * wy + (1 << 23)) >> 24);
+        }
+    }
+
+    // sample rows [y0, y1) plus one halo row each side, blur while writing
+    void ProcessRows(const cv::Mat& frame, cv::Mat& gray, int y0, int y1,
+                     std::vector<uint8_t>& rows, std::vector<uint16_t>& vsum) const
+    {
+        const int w = outputSize.width;
+        if(!blur)
+        {
+            for(int y=y0; y<y1; y++)
+                SampleRow(frame, y, gray.ptr<uint8_t>(y));
+            return;
+        }
+
+        // ring of three sampled rows, replicated at the image border
+        auto ringRow = [&rows, w](int y) { return &rows[size_t((y + 3) % 3) * w]; };
+        SampleRow(frame, std::max(y0 - 1, 0), ringRow(y0 - 1));
+        SampleRow(frame, y0, ringRow(y0));
+        for(int y=y0; y<y1; y++)
+        {
+            SampleRow(frame, std::min(y + 1, outputSize.height - 1), ringRow(y + 1));
+            const uint8_t* a = ringRow(y - 1);
+            const uint8_t* b = ringRow(y);
+            const uint8_t* c = ringRow(y + 1);
+            for(int x=0; x<w; x++)
+                vsum[x] = uint16_t(a[x] + 2 * b[x] + c[x]);
+            uint8_t* out = gray.ptr<uint8_t>(y);
+            out[0] = uint8_t((3 * vsum[0] + vsum[std::min(1, w - 1)] + 8) >> 4);
+            for(int x=1; x<w-1; x++)
+                out[x] = uint8_t((vsum[x-1] + 2 * vsum[x] + vsum[x+1] + 8) >> 4);
+            if(w > 1)
+                out[w-1] = uint8_t((vsum[w-2] + 3 * vsum[w-1] + 8) >> 4);
+        }
+    }
+
+    // 2x2 average of the finished rows [y0, y1)
+    static void Halve(const cv::Mat& gray, cv::Mat& halfImg, int y0, int y1)
+    {
+        for(int hy=y0/2; hy<std::min(halfImg.rows, y1/2); hy++)
+        {
+            const uint8_t* r0 = gray.ptr<uint8_t>(2 * hy);
+            const uint8_t* r1 = gray.ptr<uint8_t>(2 * hy + 1);
+            uint8_t* out = halfImg.ptr<uint8_t>(hy);
+            for(int x=0; x<halfImg.cols; x++)
+                out[x] = uint8_t((r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1] + 2) >> 2);
+        }
+    }
+};
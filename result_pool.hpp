@@ -0,0 +1,55 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+// ResultPool hands out reference-counted result objects and takes them back
+// when the last reference is dropped, so per-frame results are recycled
+// instead of reallocated. T::Recycle() is called before an object is reused;
+// it should drop shared data (cv::Mat, other results) but may keep vector
+// capacity. The pool may be destroyed while results are still alive.
+template<typename T>
+class ResultPool
+{
+    struct Storage
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<T>> free;
+        size_t maxFree;
+    };
+    std::shared_ptr<Storage> storage;
+
+public:
+    ResultPool(size_t maxFree=8) : storage(std::make_shared<Storage>())
+    {
+        storage->maxFree = maxFree;
+    }
+
+    // an empty object owned by the caller until the last reference is gone
+    std::shared_ptr<T> Acquire()
+    {
+        std::unique_ptr<T> item;
+        {
+            std::lock_guard<std::mutex> lock(storage->mutex);
+            if(!storage->free.empty())
+            {
+                item = std::move(storage->free.back());
+                storage->free.pop_back();
+            }
+        }
+        if(!item)
+            item.reset(new T());
+
+        std::shared_ptr<Storage> owner = storage;
+        return std::shared_ptr<T>(item.release(), [owner](T* object)
+        {
+            object->Recycle();
+            std::lock_guard<std::mutex> lock(owner->mutex);
+            if(owner->free.size() < owner->maxFree)
+                owner->free.emplace_back(object);
+            else
+                delete object;
+        });
+    }
+};
@@ -0,0 +1,595 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "feature.hpp"
+
+
+// matches of one frame against the reference for one feature type
+struct MatchReply
+{
+    std::string name;
+    int numInliers;
+    cv::Mat homography;             // reference -> input, empty if not found
+    std::vector<cv::DMatch> matches;
+};
+
+
+// Wire reads and writes the server protocol on a stream socket.
+// All values are in host byte order; the protocol is for local clients only.
+//
+// request:  uint32 magic, uint32 kind
+//           kind 0 (image):       uint32 size, encoded image bytes
+//           kind 1 (descriptors): string feature, uint32 n, n x (float x, float y), mat descriptors
+// reply:    uint32 count, count x (string name, int32 inliers, uint8 hasH, 9 x double,
+//                                  uint32 n, n x (int32 query, int32 train, float distance))
+//           or uint32 Failed, string error
+// string:   uint32 length, bytes;  mat: int32 rows, int32 cols, int32 type, data
+class Wire
+{
+public:
+    static const uint32_t Magic = 0x4d465643;   // "CVFM"
+    static const uint32_t Failed = 0xffffffff;
+    // limits on what a peer may make the reader allocate
+    static const uint32_t MaxImageBytes = 64u << 20;
+    static const uint32_t MaxKeypoints = 100000;
+    static const size_t MaxMatBytes = size_t(256) << 20;
+    enum Kind : uint32_t { Image = 0, Descriptors = 1 };
+
+    static bool Read(int fd, void* data, size_t bytes)
+    {
+        char* p = static_cast<char*>(data);
+        while(bytes > 0)
+        {
+            const ssize_t n = ::recv(fd, p, bytes, 0);
+            if(n <= 0)
+                return false;
+            p += n;
+            bytes -= size_t(n);
+        }
+        return true;
+    }
+
+    static bool Write(int fd, const void* data, size_t bytes)
+    {
+        const char* p = static_cast<const char*>(data);
+        while(bytes > 0)
+        {
+            const ssize_t n = ::send(fd, p, bytes, MSG_NOSIGNAL);
+            if(n <= 0)
+                return false;
+            p += n;
+            bytes -= size_t(n);
+        }
+        return true;
+    }
+
+    template<typename T> static bool Read(int fd, T& value) { return Read(fd, &value, sizeof(T)); }
+    template<typename T> static bool Write(int fd, const T& value) { return Write(fd, &value, sizeof(T)); }
+
+    static bool Read(int fd, std::string& text)
+    {
+        uint32_t length;
+        if(!Read(fd, length) || length > (1u << 20))
+            return false;
+        text.resize(length);
+        return length == 0 || Read(fd, &text[0], length);
+    }
+
+    static bool Write(int fd, const std::string& text)
+    {
+        return Write(fd, uint32_t(text.size())) && Write(fd, text.data(), text.size());
+    }
+
+    static bool Read(int fd, cv::Mat& mat)
+    {
+        int32_t rows, cols, type;
+        if(!Read(fd, rows) || !Read(fd, cols) || !Read(fd, type) || rows < 0 || cols < 0
+           || CV_MAT_DEPTH(type) > CV_64F || CV_MAT_CN(type) > 4 || type != CV_MAT_TYPE(type)
+           || size_t(rows) * size_t(cols) * CV_ELEM_SIZE(type) > MaxMatBytes)
+            return false;
+        mat.create(rows, cols, type);
+        return mat.empty() || Read(fd, mat.data, mat.total() * mat.elemSize());
+    }
+
+    static bool Write(int fd, const cv::Mat& mat)
+    {
+        cv::Mat data = mat.isContinuous() ? mat : mat.clone();
+        return Write(fd, int32_t(data.rows)) && Write(fd, int32_t(data.cols)) && Write(fd, int32_t(data.type()))
+               && Write(fd, data.data, data.total() * data.elemSize());
+    }
+
+    static bool Write(int fd, const std::vector<MatchReply>& replies)
+    {
+        if(!Write(fd, uint32_t(replies.size())))
+            return false;
+        for(const MatchReply& reply : replies)
+        {
+            double h[9] = {0};
+            const uint8_t hasH = reply.homography.empty() ? 0 : 1;
+            for(int i=0; hasH && i<9; i++)
+                h[i] = reply.homography.at<double>(i / 3, i % 3);
+            if(!Write(fd, reply.name) || !Write(fd, int32_t(reply.numInliers)) || !Write(fd, hasH)
+               || !Write(fd, h, sizeof(h)) || !Write(fd, uint32_t(reply.matches.size())))
+                return false;
+            for(const cv::DMatch& m : reply.matches)
+                if(!Write(fd, int32_t(m.queryIdx)) || !Write(fd, int32_t(m.trainIdx)) || !Write(fd, m.distance))
+                    return false;
+        }
+        return true;
+    }
+
+    static bool WriteError(int fd, const std::string& error)
+    {
+        return Write(fd, Failed) && Write(fd, error);
+    }
+
+    // error is set and replies left empty if the server failed the request
+    static bool Read(int fd, std::vector<MatchReply>& replies, std::string& error)
+    {
+        uint32_t count;
+        error.clear();
+        replies.clear();
+        if(!Read(fd, count))
+            return false;
+        if(count == Failed)
+            return Read(fd, error);
+        if(count > 4096)
+            return false;
+        replies.assign(count, MatchReply());
+        for(MatchReply& reply : replies)
+        {
+            int32_t inliers;
+            uint8_t hasH;
+            double h[9];
+            uint32_t numMatches;
+            if(!Read(fd, reply.name) || !Read(fd, inliers) || !Read(fd, hasH) || !Read(fd, h, sizeof(h))
+               || !Read(fd, numMatches) || numMatches > MaxKeypoints * 8)
+                return false;
+            reply.numInliers = inliers;
+            if(hasH)
+                reply.homography = cv::Mat(3, 3, CV_64F, h).clone();
+            reply.matches.resize(numMatches);
+            for(cv::DMatch& m : reply.matches)
+            {
+                int32_t query, train;
+                if(!Read(fd, query) || !Read(fd, train) || !Read(fd, m.distance))
+                    return false;
+                m.queryIdx = query;
+                m.trainIdx = train;
+            }
+        }
+        return true;
+    }
+};
+
+
+// MatchServer holds the reference features and matcher indexes once and
+// serves many local clients over a Unix domain socket. Requests from all
+// clients are collected into batches (up to maxBatch requests, waiting at
+// most maxWaitMs after the first one) and matched in one shared pass per
+// feature type, so every index is queried once per batch instead of once
+// per client
+class MatchServer
+{
+    struct Job
+    {
+        cv::Mat image;                  // image request
+        std::string feature;            // descriptor request
+        DetectResultPtr described;
+        std::string error;              // set instead of replies if the request failed
+        std::promise<std::vector<MatchReply>> reply;
+    };
+
+    struct Client
+    {
+        int fd;                         // -1 once closed
+        bool finished;
+        std::thread thread;
+    };
+
+    std::string socketPath;
+    std::vector<Detector> engines;
+    std::vector<DetectResultPtr> references;
+    std::vector<Matcher> matchers;
+    size_t maxBatch;
+    int maxWaitMs;
+
+    int listenFd;
+    std::atomic<bool> running;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::deque<std::shared_ptr<Job>> queue;
+    std::thread batcher;
+    std::mutex clientMutex;
+    std::list<Client> clients;
+
+public:
+    MatchServer(const std::string _socketPath, const std::vector<std::string> features,
+                const std::vector<std::string> matcherNames, cv::Mat refimg,
+                size_t _maxBatch=16, int _maxWaitMs=5)
+        : socketPath(_socketPath), maxBatch(_maxBatch), maxWaitMs(_maxWaitMs), listenFd(-1), running(false)
+    {
+        assert(features.size() == matcherNames.size());
+        for(size_t i=0; i<features.size(); i++)
+        {
+            if(matcherNames[i] == "sketch")
+                throw std::string("the server needs a trainable matcher, not sketch");
+            engines.push_back(Detector::Factory(features[i]));
+            Detector refer = engines.back().Share();
+            refer.DetectAndCompute(refimg);
+            references.push_back(refer.getResult());
+            matchers.push_back(Matcher::Factory(matcherNames[i], features[i]));
+            matchers.back().Train(references.back()->descriptors);
+        }
+    }
+
+    ~MatchServer()
+    {
+        Stop();
+    }
+
+    // accept clients until Stop() is called from another thread
+    void Run()
+    {
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+        ::unlink(socketPath.c_str());
+        if(listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+           || ::listen(listenFd, 64) != 0)
+            throw std::string("cannot listen on ") + socketPath;
+
+        running = true;
+        batcher = std::thread(&MatchServer::BatchLoop, this);
+        std::cout << "matching server on " << socketPath << std::endl;
+        while(running)
+        {
+            const int fd = ::accept(listenFd, nullptr, nullptr);
+            if(fd < 0)
+                continue;
+            std::lock_guard<std::mutex> lock(clientMutex);
+            ReapClients();
+            clients.emplace_back();
+            Client& client = clients.back();
+            client.fd = fd;
+            client.finished = false;
+            client.thread = std::thread(&MatchServer::ServeClient, this, &client);
+        }
+    }
+
+    void Stop()
+    {
+        if(!running.exchange(false))
+            return;
+        ::shutdown(listenFd, SHUT_RDWR);
+        ::close(listenFd);
+        ::unlink(socketPath.c_str());
+        queueReady.notify_all();
+        batcher.join();
+        std::lock_guard<std::mutex> lock(clientMutex);
+        for(Client& client : clients)
+            if(client.fd >= 0)
+                ::shutdown(client.fd, SHUT_RDWR);
+        for(Client& client : clients)
+            client.thread.join();
+        clients.clear();
+    }
+
+private:
+    // threads of clients that went away; call with clientMutex held
+    void ReapClients()
+    {
+        for(auto client = clients.begin(); client != clients.end();)
+        {
+            if(!client->finished)
+            {
+                ++client;
+                continue;
+            }
+            client->thread.join();
+            client = clients.erase(client);
+        }
+    }
+
+    void ServeClient(Client* client)
+    {
+        const int fd = client->fd;
+        while(true)
+        {
+            std::shared_ptr<Job> job = ReadJob(fd);
+            if(!job)
+                break;
+            std::future<std::vector<MatchReply>> reply = job->reply.get_future();
+            {
+                // the batcher drains the queue before it stops, so nothing is queued after that
+                std::lock_guard<std::mutex> lock(queueMutex);
+                if(!running)
+                    break;
+                queue.push_back(job);
+            }
+            queueReady.notify_one();
+            std::vector<MatchReply> replies = reply.get();
+            if(!(job->error.empty() ? Wire::Write(fd, replies) : Wire::WriteError(fd, job->error)))
+                break;
+        }
+        std::lock_guard<std::mutex> lock(clientMutex);
+        ::close(fd);
+        client->fd = -1;
+        client->finished = true;
+    }
+
+    std::shared_ptr<Job> ReadJob(int fd)
+    {
+        uint32_t magic, kind;
+        if(!Wire::Read(fd, magic) || magic != Wire::Magic || !Wire::Read(fd, kind))
+            return nullptr;
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        if(kind == Wire::Image)
+        {
+            uint32_t size;
+            if(!Wire::Read(fd, size) || size > Wire::MaxImageBytes)
+                return nullptr;
+            std::vector<uchar> bytes(size);
+            if(size > 0 && !Wire::Read(fd, bytes.data(), size))
+                return nullptr;
+            try
+            {
+                job->image = cv::imdecode(bytes, cv::IMREAD_UNCHANGED);
+            }
+            catch(const std::exception&)
+            {
+            }
+            if(job->image.empty())
+                job->error = "cannot decode image";
+        }
+        else if(kind == Wire::Descriptors)
+        {
+            std::shared_ptr<DetectResult> described = std::make_shared<DetectResult>();
+            uint32_t numKeypts;
+            if(!Wire::Read(fd, job->feature) || !Wire::Read(fd, numKeypts) || numKeypts > Wire::MaxKeypoints)
+                return nullptr;
+            described->name = job->feature;
+            described->keypts.resize(numKeypts);
+            for(cv::KeyPoint& kp : described->keypts)
+                if(!Wire::Read(fd, kp.pt.x) || !Wire::Read(fd, kp.pt.y))
+                    return nullptr;
+            if(!Wire::Read(fd, described->descriptors) || described->descriptors.rows != int(numKeypts))
+                return nullptr;
+            job->described = described;
+            job->error = "no " + job->feature + " index with " + std::to_string(described->descriptors.cols)
+                         + " column descriptors of type " + std::to_string(described->descriptors.type());
+            for(size_t p=0; p<engines.size(); p++)
+                if(Compatible(*described, p))
+                    job->error.clear();
+        }
+        else
+            return nullptr;
+        return job;
+    }
+
+    // wait for a first job, then collect more until the batch is full or maxWaitMs passed
+    void BatchLoop()
+    {
+        while(true)
+        {
+            std::vector<std::shared_ptr<Job>> batch;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueReady.wait(lock, [this] { return !running || !queue.empty(); });
+                if(!running && queue.empty())
+                    return;
+                const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(maxWaitMs);
+                queueReady.wait_until(lock, deadline, [this] { return !running || queue.size() >= maxBatch; });
+                while(!queue.empty() && batch.size() < maxBatch)
+                {
+                    batch.push_back(queue.front());
+                    queue.pop_front();
+                }
+            }
+            try
+            {
+                ProcessBatch(batch);
+            }
+            catch(const std::exception& e)
+            {
+                // ProcessBatch answers nothing before it has finished
+                for(auto& job : batch)
+                {
+                    job->error = std::string("batch failed: ") + e.what();
+                    job->reply.set_value(std::vector<MatchReply>());
+                }
+            }
+        }
+    }
+
+    // descriptors a pair's trained index can take
+    bool Compatible(const DetectResult& input, size_t p)
+    {
+        const cv::Mat& trained = references[p]->descriptors;
+        return input.name == engines[p].GetName() && input.descriptors.type() == trained.type()
+               && input.descriptors.cols == trained.cols;
+    }
+
+    void ProcessBatch(std::vector<std::shared_ptr<Job>>& batch)
+    {
+        const int numPairs = int(matchers.size());
+
+        // describe image requests; descriptor requests go to their own feature type.
+        // a failure only fails its own request
+        std::mutex errorMutex;
+        auto fail = [&](size_t j, const std::string& error)
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if(batch[j]->error.empty())
+                batch[j]->error = error;
+        };
+        std::vector<char> rejected(batch.size());
+        for(size_t j=0; j<batch.size(); j++)
+            rejected[j] = !batch[j]->error.empty();
+        std::vector<std::vector<DetectResultPtr>> inputs(batch.size(), std::vector<DetectResultPtr>(numPairs));
+        cv::parallel_for_(cv::Range(0, int(batch.size()) * numPairs), [&](const cv::Range& range)
+        {
+            for(int task=range.start; task<range.end; task++)
+            {
+                const int j = task / numPairs, p = task % numPairs;
+                if(rejected[j])
+                    continue;
+                if(batch[j]->described)
+                {
+                    if(Compatible(*batch[j]->described, p))
+                        inputs[j][p] = batch[j]->described;
+                    continue;
+                }
+                try
+                {
+                    Detector input = engines[p].Share();
+                    input.DetectAndCompute(batch[j]->image);
+                    inputs[j][p] = input.getResult();
+                }
+                catch(const std::exception& e)
+                {
+                    fail(j, e.what());
+                }
+            }
+        });
+
+        std::vector<std::vector<MatchReply>> replies(batch.size());
+        for(int p=0; p<numPairs; p++)
+        {
+            // one matching pass over the stacked queries of the whole batch
+            cv::Mat stacked;
+            std::vector<int> offsets, owners;
+            for(size_t j=0; j<batch.size(); j++)
+                if(batch[j]->error.empty() && inputs[j][p] && !inputs[j][p]->descriptors.empty())
+                {
+                    offsets.push_back(stacked.rows);
+                    owners.push_back(int(j));
+                    stacked.push_back(inputs[j][p]->descriptors);
+                }
+            std::vector<cv::DMatch> all;
+            try
+            {
+                if(!stacked.empty())
+                    matchers[p].MatchTrained(stacked, all);
+            }
+            catch(const std::exception& e)
+            {
+                for(int owner : owners)
+                    fail(owner, e.what());
+                continue;
+            }
+
+            std::vector<std::vector<cv::DMatch>> split(owners.size());
+            for(cv::DMatch m : all)
+            {
+                const size_t k = std::upper_bound(offsets.begin(), offsets.end(), m.queryIdx) - offsets.begin() - 1;
+                m.queryIdx -= offsets[k];
+                m.imgIdx = 0;
+                split[k].push_back(m);
+            }
+
+            for(size_t k=0; k<owners.size(); k++)
+            {
+                MatcherResult result;
+                result.name = matchers[p].GetName();
+                result.refer = references[p];
+                result.input = inputs[owners[k]][p];
+                result.matches.swap(split[k]);
+                Matcher::KeepBest(result.matches);
+                try
+                {
+                    result.numInliers = matchers[p].EstimateHomography(result);
+                }
+                catch(const std::exception& e)
+                {
+                    fail(owners[k], e.what());
+                    continue;
+                }
+                replies[owners[k]].push_back({engines[p].GetName(), result.numInliers,
+                                              result.homography, result.matches});
+            }
+        }
+
+        for(size_t j=0; j<batch.size(); j++)
+            batch[j]->reply.set_value(batch[j]->error.empty() ? replies[j] : std::vector<MatchReply>());
+    }
+};
+
+
+// MatchClient talks to a MatchServer; one request at a time per client
+class MatchClient
+{
+    int fd;
+
+public:
+    MatchClient(const std::string socketPath)
+    {
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+        if(fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            throw std::string("cannot connect to ") + socketPath;
+    }
+
+    MatchClient(const MatchClient&) = delete;
+    MatchClient& operator=(const MatchClient&) = delete;
+
+    ~MatchClient()
+    {
+        ::close(fd);
+    }
+
+    // the server detects with every configured feature type;
+    // ".png" keeps the frame lossless, ".jpg" is smaller
+    std::vector<MatchReply> MatchImage(const cv::Mat& image, const std::string encoding=".png")
+    {
+        std::vector<uchar> bytes;
+        cv::imencode(encoding, image, bytes);
+        if(!Wire::Write(fd, Wire::Magic) || !Wire::Write(fd, uint32_t(Wire::Image))
+           || !Wire::Write(fd, uint32_t(bytes.size())) || !Wire::Write(fd, bytes.data(), bytes.size()))
+            throw std::string("server connection lost");
+        return Receive();
+    }
+
+    // precomputed features of one type, matched without detection on the server
+    std::vector<MatchReply> MatchDescriptors(const std::string feature, const std::vector<cv::KeyPoint>& keypts,
+                                             const cv::Mat& descriptors)
+    {
+        bool ok = Wire::Write(fd, Wire::Magic) && Wire::Write(fd, uint32_t(Wire::Descriptors))
+                  && Wire::Write(fd, feature) && Wire::Write(fd, uint32_t(keypts.size()));
+        for(size_t i=0; ok && i<keypts.size(); i++)
+            ok = Wire::Write(fd, keypts[i].pt.x) && Wire::Write(fd, keypts[i].pt.y);
+        if(!ok || !Wire::Write(fd, descriptors))
+            throw std::string("server connection lost");
+        return Receive();
+    }
+
+private:
+    std::vector<MatchReply> Receive()
+    {
+        std::vector<MatchReply> replies;
+        std::string error;
+        if(!Wire::Read(fd, replies, error))
+            throw std::string("server connection lost");
+        if(!error.empty())
+            throw std::string("server: ") + error;
+        return replies;
+    }
+};
@@ -0,0 +1,293 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "feature.hpp"
+#include "server.hpp"
+
+
+// ShardWorker serves one partition of the reference descriptors in its own
+// process and answers k nearest neighbour queries against it.
+// requests on the socket (see Wire):
+//   Add:   int32 reference, mat descriptors
+//   Take:  int32 reference             -> mat descriptors (removed from the shard)
+//   Query: int32 k, mat descriptors    -> uint32 rows, rows x (uint32 n, n x (int32 reference, int32 train, float distance))
+//   Quit
+class ShardWorker
+{
+    int fd;
+    Matcher matcher;
+    std::map<int, cv::Mat> references;
+    std::vector<std::pair<int, int>> rows;      // index row -> (reference, keypoint)
+    bool dirty;
+
+public:
+    enum Op : uint32_t { Add = 1, Take = 2, Query = 3, Quit = 4 };
+
+    ShardWorker(int _fd, const std::string feature, const std::string matcherName)
+        : fd(_fd), matcher(Matcher::Factory(matcherName, feature)), dirty(false) {}
+
+    // returns when the coordinator quits or goes away
+    void Serve()
+    {
+        uint32_t op;
+        while(Wire::Read(fd, op) && op != Quit)
+        {
+            int32_t reference, k;
+            cv::Mat descriptors;
+            bool ok = false;
+            switch(op)
+            {
+            case Add:
+                ok = Wire::Read(fd, reference) && Wire::Read(fd, descriptors);
+                references[reference] = descriptors;
+                dirty = true;
+                break;
+            case Take:
+                ok = Wire::Read(fd, reference);
+                if(ok && references.count(reference))
+                {
+                    descriptors = references[reference];
+                    references.erase(reference);
+                    dirty = true;
+                }
+                ok = ok && Wire::Write(fd, descriptors);
+                break;
+            case Query:
+                ok = Wire::Read(fd, k) && Wire::Read(fd, descriptors) && Answer(descriptors, k);
+                break;
+            }
+            if(!ok)
+                break;
+        }
+        ::close(fd);
+    }
+
+private:
+    bool Answer(const cv::Mat& descriptors, int k)
+    {
+        if(dirty)
+            Reindex();
+        std::vector<std::vector<cv::DMatch>> knn;
+        if(!rows.empty() && !descriptors.empty())
+            matcher.KnnTrained(descriptors, k, knn);
+        knn.resize(descriptors.rows);
+
+        if(!Wire::Write(fd, uint32_t(knn.size())))
+            return false;
+        for(const std::vector<cv::DMatch>& neighbours : knn)
+        {
+            if(!Wire::Write(fd, uint32_t(neighbours.size())))
+                return false;
+            for(const cv::DMatch& m : neighbours)
+                if(!Wire::Write(fd, int32_t(rows[m.trainIdx].first)) || !Wire::Write(fd, int32_t(rows[m.trainIdx].second))
+                   || !Wire::Write(fd, m.distance))
+                    return false;
+        }
+        return true;
+    }
+
+    // one index over every reference of the shard
+    void Reindex()
+    {
+        cv::Mat all;
+        rows.clear();
+        for(const auto& reference : references)
+        {
+            all.push_back(reference.second);
+            for(int i=0; i<reference.second.rows; i++)
+                rows.emplace_back(reference.first, i);
+        }
+        if(!all.empty())
+            matcher.Train(all);
+        dirty = false;
+    }
+};
+
+
+// ShardedReferenceDB spreads reference descriptors of one feature type over
+// worker processes, each holding its own index, so no process needs the
+// whole set. Queries are scattered to every shard at once and the per-shard
+// top-k lists merged. Workers are this executable started with
+// --shard-worker (see main), not bare forks, so they start without the
+// coordinator's threads
+class ShardedReferenceDB
+{
+    struct Shard
+    {
+        pid_t pid;
+        int fd;
+        size_t rows;
+    };
+
+    std::vector<Shard> shards;
+    std::map<int, std::pair<int, size_t>> placement;    // reference -> (shard, rows)
+
+public:
+    ShardedReferenceDB(int numShards, const std::string feature, const std::string matcherName,
+                       const std::string executable="/proc/self/exe")
+    {
+        for(int i=0; i<numShards; i++)
+        {
+            int fds[2];
+            if(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+                throw std::string("cannot create shard socket");
+            const pid_t pid = ::fork();
+            if(pid == 0)
+            {
+                ::fcntl(fds[1], F_SETFD, 0);
+                const std::string fd = std::to_string(fds[1]);
+                ::execl(executable.c_str(), executable.c_str(), "--shard-worker", fd.c_str(),
+                        feature.c_str(), matcherName.c_str(), static_cast<char*>(nullptr));
+                ::_exit(127);
+            }
+            ::close(fds[1]);
+            if(pid < 0)
+            {
+                ::close(fds[0]);
+                throw std::string("cannot start shard worker");
+            }
+            shards.push_back({pid, fds[0], 0});
+        }
+    }
+
+    ShardedReferenceDB(const ShardedReferenceDB&) = delete;
+    ShardedReferenceDB& operator=(const ShardedReferenceDB&) = delete;
+
+    ~ShardedReferenceDB()
+    {
+        for(Shard& shard : shards)
+        {
+            Wire::Write(shard.fd, uint32_t(ShardWorker::Quit));
+            ::close(shard.fd);
+            ::waitpid(shard.pid, nullptr, 0);
+        }
+    }
+
+    // entry point of a worker process
+    static int RunWorker(int fd, const std::string feature, const std::string matcherName)
+    {
+        ::signal(SIGPIPE, SIG_IGN);
+        ShardWorker(fd, feature, matcherName).Serve();
+        return 0;
+    }
+
+    // the reference goes to the shard holding the fewest descriptors
+    void Add(int reference, const cv::Mat& descriptors)
+    {
+        Remove(reference);
+        int lightest = 0;
+        for(int i=1; i<int(shards.size()); i++)
+            if(shards[i].rows < shards[lightest].rows)
+                lightest = i;
+        Place(reference, lightest, descriptors);
+    }
+
+    void Remove(int reference)
+    {
+        if(placement.count(reference))
+            TakeBack(reference);
+    }
+
+    size_t NumShards() const { return shards.size(); }
+    size_t ShardRows(int i) const { return shards[i].rows; }
+
+    // k nearest reference descriptors of every query row over all shards,
+    // closest first; imgIdx is the reference and trainIdx its keypoint
+    std::vector<std::vector<cv::DMatch>> Query(const cv::Mat& descriptors, int k)
+    {
+        for(Shard& shard : shards)
+            if(!Wire::Write(shard.fd, uint32_t(ShardWorker::Query)) || !Wire::Write(shard.fd, int32_t(k))
+               || !Wire::Write(shard.fd, descriptors))
+                throw std::string("shard worker lost");
+
+        std::vector<std::vector<cv::DMatch>> merged(descriptors.rows);
+        for(Shard& shard : shards)
+        {
+            uint32_t numRows;
+            if(!Wire::Read(shard.fd, numRows) || numRows != uint32_t(descriptors.rows))
+                throw std::string("shard worker lost");
+            for(uint32_t row=0; row<numRows; row++)
+            {
+                uint32_t n;
+                if(!Wire::Read(shard.fd, n))
+                    throw std::string("shard worker lost");
+                for(uint32_t j=0; j<n; j++)
+                {
+                    int32_t reference, train;
+                    float distance;
+                    if(!Wire::Read(shard.fd, reference) || !Wire::Read(shard.fd, train) || !Wire::Read(shard.fd, distance))
+                        throw std::string("shard worker lost");
+                    merged[row].push_back(cv::DMatch(int(row), train, reference, distance));
+                }
+            }
+        }
+        for(std::vector<cv::DMatch>& neighbours : merged)
+        {
+            std::sort(neighbours.begin(), neighbours.end());
+            if(int(neighbours.size()) > k)
+                neighbours.resize(k);
+        }
+        return merged;
+    }
+
+    // move references from the heaviest to the lightest shard until their
+    // descriptor counts differ by at most tolerance of the mean
+    void Rebalance(double tolerance=0.1)
+    {
+        size_t total = 0;
+        for(const Shard& shard : shards)
+            total += shard.rows;
+        const double allowed = tolerance * total / std::max<size_t>(shards.size(), 1);
+        while(shards.size() > 1)
+        {
+            auto byRows = [](const Shard& a, const Shard& b) { return a.rows < b.rows; };
+            const int heaviest = int(std::max_element(shards.begin(), shards.end(), byRows) - shards.begin());
+            const int lightest = int(std::min_element(shards.begin(), shards.end(), byRows) - shards.begin());
+            const size_t gap = shards[heaviest].rows - shards[lightest].rows;
+            if(gap <= allowed)
+                break;
+
+            // largest reference that narrows the gap
+            int move = -1;
+            size_t moveRows = 0;
+            for(const auto& placed : placement)
+                if(placed.second.first == heaviest && placed.second.second * 2 <= gap && placed.second.second > moveRows)
+                {
+                    move = placed.first;
+                    moveRows = placed.second.second;
+                }
+            if(move < 0)
+                break;
+            Place(move, lightest, TakeBack(move));
+        }
+    }
+
+private:
+    void Place(int reference, int i, const cv::Mat& descriptors)
+    {
+        if(!Wire::Write(shards[i].fd, uint32_t(ShardWorker::Add)) || !Wire::Write(shards[i].fd, int32_t(reference))
+           || !Wire::Write(shards[i].fd, descriptors))
+            throw std::string("shard worker lost");
+        shards[i].rows += descriptors.rows;
+        placement[reference] = std::make_pair(i, size_t(descriptors.rows));
+    }
+
+    cv::Mat TakeBack(int reference)
+    {
+        const int i = placement[reference].first;
+        cv::Mat descriptors;
+        if(!Wire::Write(shards[i].fd, uint32_t(ShardWorker::Take)) || !Wire::Write(shards[i].fd, int32_t(reference))
+           || !Wire::Read(shards[i].fd, descriptors))
+            throw std::string("shard worker lost");
+        shards[i].rows -= placement[reference].second;
+        placement.erase(reference);
+        return descriptors;
+    }
+};
@@ -0,0 +1,152 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <opencv2/opencv.hpp>
+
+
+// BinarySketch turns float descriptors (SIFT, SURF, ...) into compact bit
+// strings: bit b is the sign of the projection of the row-centred descriptor
+// onto the b-th random Gaussian direction (SimHash). Hamming distance between
+// sketches then tracks the angle between descriptors
+class BinarySketch
+{
+public:
+    // bits x dims projection, identical for every caller with the same shape
+    static cv::Mat Projection(int dims, int bits)
+    {
+        static std::mutex mutex;
+        static std::map<std::pair<int,int>, cv::Mat> cache;
+        std::lock_guard<std::mutex> lock(mutex);
+        cv::Mat& projection = cache[std::make_pair(dims, bits)];
+        if(projection.empty())
+        {
+            projection.create(bits, dims, CV_32F);
+            cv::RNG rng(0x5eed + dims * 131 + bits);
+            rng.fill(projection, cv::RNG::NORMAL, 0.0, 1.0);
+        }
+        return projection;
+    }
+
+    // one row of bits/8 bytes per descriptor row
+    static cv::Mat Compute(const cv::Mat& descriptors, int bits)
+    {
+        CV_Assert(bits % 8 == 0);
+        cv::Mat sketch(descriptors.rows, bits / 8, CV_8U, cv::Scalar(0));
+        if(descriptors.empty())
+            return sketch;
+
+        cv::Mat desc;
+        descriptors.convertTo(desc, CV_32F);
+        const cv::Mat projection = Projection(desc.cols, bits);
+        cv::Mat projected;
+        cv::gemm(desc, projection, 1.0, cv::noArray(), 0.0, projected, cv::GEMM_2_T);
+
+        // centring each descriptor removes the bias of non-negative histograms:
+        // (x - mean(x)) . p = x . p - mean(x) * sum(p)
+        cv::Mat rowMeans, projSums;
+        cv::reduce(desc, rowMeans, 1, cv::REDUCE_AVG);
+        cv::reduce(projection, projSums, 1, cv::REDUCE_SUM);
+        for(int r=0; r<desc.rows; r++)
+        {
+            const float* proj = projected.ptr<float>(r);
+            const float mean = rowMeans.at<float>(r);
+            const float* sums = projSums.ptr<float>(0);
+            uchar* out = sketch.ptr<uchar>(r);
+            for(int b=0; b<bits; b++)
+                if(proj[b] - mean * sums[b] > 0)
+                    out[b >> 3] |= uchar(1 << (b & 7));
+        }
+        return sketch;
+    }
+};
+
+
+// SketchMatcher is a two-stage nearest-neighbour search for float descriptors:
+// a Hamming-distance shortlist over binary sketches (popcount-vectorized
+// inside OpenCV) followed by exact re-ranking of the shortlist only.
+// Every few calls it checks a sample of queries against exhaustive search
+// and keeps a running recall estimate
+class SketchMatcher
+{
+    int shortlist;
+    int normType;
+    cv::Ptr<cv::BFMatcher> hamming;
+    cv::Ptr<cv::BFMatcher> exact;
+    long calls;
+    long sampled;
+    long agreed;
+    const int recallInterval = 30;
+    const int recallSamples = 64;
+
+public:
+    SketchMatcher(int _shortlist=8, int _normType=cv::NORM_L2)
+        : shortlist(_shortlist), normType(_normType), 
+          hamming(cv::BFMatcher::create(cv::NORM_HAMMING)), exact(cv::BFMatcher::create(_normType)),
+          calls(0), sampled(0), agreed(0) {}
+
+    void SetShortlist(int _shortlist) { shortlist = std::max(1, _shortlist); }
+    int Shortlist() const { return shortlist; }
+
+    // fraction of sampled queries whose exact nearest neighbour survived the shortlist
+    double Recall() const { return sampled ? double(agreed) / sampled : 1.0; }
+    long RecallSamples() const { return sampled; }
+
+    void Match(const cv::Mat& referDesc, const cv::Mat& referSketch,
+               const cv::Mat& inputDesc, const cv::Mat& inputSketch,
+               std::vector<cv::DMatch>& matches)
+    {
+        matches.clear();
+        if(referDesc.empty() || inputDesc.empty())
+            return;
+
+        std::vector<std::vector<cv::DMatch>> candidates;
+        hamming->knnMatch(inputSketch, referSketch, candidates, shortlist);
+
+        cv::Mat input, refer;
+        inputDesc.convertTo(input, CV_32F);
+        referDesc.convertTo(refer, CV_32F);
+        for(size_t q=0; q<candidates.size(); q++)
+        {
+            cv::DMatch best;
+            for(const cv::DMatch& c : candidates[q])
+            {
+                const float d = float(cv::norm(input.row(int(q)), refer.row(c.trainIdx), normType));
+                if(best.trainIdx < 0 || d < best.distance || (d == best.distance && c.trainIdx < best.trainIdx))
+                    best = cv::DMatch(int(q), c.trainIdx, d);
+            }
+            if(best.trainIdx >= 0)
+                matches.push_back(best);
+        }
+
+        if(calls++ % recallInterval == 0)
+            MeasureRecall(input, refer, matches);
+    }
+
+private:
+    void MeasureRecall(const cv::Mat& input, const cv::Mat& refer, const std::vector<cv::DMatch>& matches)
+    {
+        const int step = std::max(1, int(matches.size()) / recallSamples);
+        cv::Mat queries;
+        std::vector<const cv::DMatch*> picked;
+        for(size_t i=0; i<matches.size(); i+=step)
+        {
+            queries.push_back(input.row(matches[i].queryIdx));
+            picked.push_back(&matches[i]);
+        }
+        if(picked.empty())
+            return;
+
+        std::vector<cv::DMatch> truth;
+        exact->match(queries, refer, truth);
+        for(size_t i=0; i<truth.size(); i++)
+        {
+            sampled++;
+            // equal distance counts as found, ties may pick another index;
+            // the two norm implementations may round differently
+            if(picked[i]->distance <= truth[i].distance * (1 + 1e-5f) + 1e-6f)
+                agreed++;
+        }
+    }
+};
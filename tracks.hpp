@@ -0,0 +1,213 @@
+#pragma once
+#include <vector>
+#include <cfloat>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+
+// TrackManager gives keypoints that persist over consecutive frames a
+// stable id. Live tracks are predicted with constant velocity and only
+// matched against the frame's keypoints near their prediction, so a long
+// track costs a few descriptor comparisons per frame instead of a full
+// match. Track state and histories are stored column-wise (one array per
+// field, indexed by slot) with a fixed-capacity ring buffer of positions
+// per track, so nothing is allocated once the store is warm
+class TrackManager
+{
+    int maxTracks;
+    int historyLength;
+    float searchRadius;
+    int maxMissed;
+    long nextId;
+
+    // per slot
+    std::vector<long> ids;              // -1 for a free slot
+    std::vector<float> posX, posY;
+    std::vector<float> velX, velY;
+    std::vector<int> missed;
+    std::vector<int> length;            // frames observed
+    std::vector<int> head;              // newest history entry
+    cv::Mat descriptors;                // last descriptor per slot
+    // per slot x historyLength
+    std::vector<float> histX, histY;
+    std::vector<long> histFrame;
+
+    // keypoint buckets of the current frame, cell size searchRadius
+    std::vector<std::vector<int>> grid;
+    int gridCols, gridRows;
+
+public:
+    TrackManager(int _maxTracks=1000, int _historyLength=32, float _searchRadius=12.f, int _maxMissed=3)
+        : maxTracks(_maxTracks), historyLength(_historyLength), searchRadius(_searchRadius),
+          maxMissed(_maxMissed), nextId(0),
+          ids(_maxTracks, -1), posX(_maxTracks), posY(_maxTracks), velX(_maxTracks), velY(_maxTracks),
+          missed(_maxTracks), length(_maxTracks), head(_maxTracks),
+          histX(_maxTracks * _historyLength), histY(_maxTracks * _historyLength),
+          histFrame(_maxTracks * _historyLength), gridCols(0), gridRows(0) {}
+
+    // continue tracks into the keypoints of a new frame and start tracks
+    // on the strongest keypoints nobody claimed
+    void Update(long frame, const std::vector<cv::KeyPoint>& keypts, const cv::Mat& desc)
+    {
+        if(descriptors.empty() && !desc.empty())
+            descriptors.create(maxTracks, desc.cols, desc.type());
+        BuildGrid(keypts);
+
+        // best candidate near every predicted track position
+        std::vector<std::pair<float, std::pair<int, int>>> proposals;     // (distance, (slot, keypoint))
+        for(int slot=0; slot<maxTracks; slot++)
+        {
+            if(ids[slot] < 0)
+                continue;
+            const cv::Point2f predicted(posX[slot] + velX[slot], posY[slot] + velY[slot]);
+            int best = -1;
+            float bestDist = FLT_MAX, secondDist = FLT_MAX;
+            ForNeighbours(keypts, predicted, [&](int k)
+            {
+                const float dist = Distance(descriptors.row(slot), desc.row(k));
+                if(dist < bestDist)
+                {
+                    secondDist = bestDist;
+                    bestDist = dist;
+                    best = k;
+                }
+                else if(dist < secondDist)
+                    secondDist = dist;
+            });
+            if(best >= 0 && bestDist < 0.9f * secondDist && (desc.type() != CV_8U || bestDist <= 64))
+                proposals.push_back(std::make_pair(bestDist, std::make_pair(slot, best)));
+        }
+
+        // closest pairs first, each keypoint continues at most one track
+        std::sort(proposals.begin(), proposals.end());
+        std::vector<bool> claimed(keypts.size(), false);
+        std::vector<bool> continued(maxTracks, false);
+        for(const auto& proposal : proposals)
+        {
+            const int slot = proposal.second.first, k = proposal.second.second;
+            if(claimed[k])
+                continue;
+            claimed[k] = true;
+            continued[slot] = true;
+            velX[slot] = keypts[k].pt.x - posX[slot];
+            velY[slot] = keypts[k].pt.y - posY[slot];
+            Observe(slot, frame, keypts[k].pt, desc.row(k));
+        }
+
+        for(int slot=0; slot<maxTracks; slot++)
+            if(ids[slot] >= 0 && !continued[slot] && ++missed[slot] > maxMissed)
+                ids[slot] = -1;
+
+        // new tracks in free slots, strongest keypoints first
+        std::vector<int> fresh;
+        for(size_t k=0; k<keypts.size(); k++)
+            if(!claimed[k])
+                fresh.push_back(int(k));
+        std::sort(fresh.begin(), fresh.end(), [&](int a, int b) { return keypts[a].response > keypts[b].response; });
+        int slot = 0;
+        for(int k : fresh)
+        {
+            while(slot < maxTracks && ids[slot] >= 0)
+                slot++;
+            if(slot == maxTracks)
+                break;
+            ids[slot] = nextId++;
+            length[slot] = 0;
+            velX[slot] = velY[slot] = 0;
+            Observe(slot, frame, keypts[k].pt, desc.row(k));
+        }
+    }
+
+    void Reset()
+    {
+        std::fill(ids.begin(), ids.end(), -1);
+        descriptors.release();
+    }
+
+    int Capacity() const { return maxTracks; }
+    // a slot holds a track if Id(slot) >= 0
+    long Id(int slot) const { return ids[slot]; }
+    cv::Point2f Position(int slot) const { return cv::Point2f(posX[slot], posY[slot]); }
+    cv::Point2f Velocity(int slot) const { return cv::Point2f(velX[slot], velY[slot]); }
+    // frames the track was observed in, including ones older than the history
+    int Length(int slot) const { return length[slot]; }
+    // frames the track has not been found in, 0 if seen in the last frame
+    int Missed(int slot) const { return missed[slot]; }
+
+    int NumTracks() const
+    {
+        return int(std::count_if(ids.begin(), ids.end(), [](long id) { return id >= 0; }));
+    }
+
+    // positions of the last historyLength observations, oldest first
+    void History(int slot, std::vector<cv::Point2f>& points, std::vector<long>* frames=nullptr) const
+    {
+        points.clear();
+        if(frames)
+            frames->clear();
+        const int n = std::min(length[slot], historyLength);
+        for(int i=n-1; i>=0; i--)
+        {
+            const int h = slot * historyLength + (head[slot] - i + historyLength) % historyLength;
+            points.push_back(cv::Point2f(histX[h], histY[h]));
+            if(frames)
+                frames->push_back(histFrame[h]);
+        }
+    }
+
+private:
+    void Observe(int slot, long frame, cv::Point2f pt, const cv::Mat& desc)
+    {
+        posX[slot] = pt.x;
+        posY[slot] = pt.y;
+        missed[slot] = 0;
+        desc.copyTo(descriptors.row(slot));
+        head[slot] = length[slot] == 0 ? 0 : (head[slot] + 1) % historyLength;
+        length[slot]++;
+        const int h = slot * historyLength + head[slot];
+        histX[h] = pt.x;
+        histY[h] = pt.y;
+        histFrame[h] = frame;
+    }
+
+    void BuildGrid(const std::vector<cv::KeyPoint>& keypts)
+    {
+        float maxX = 0, maxY = 0;
+        for(const cv::KeyPoint& kp : keypts)
+        {
+            maxX = std::max(maxX, kp.pt.x);
+            maxY = std::max(maxY, kp.pt.y);
+        }
+        gridCols = int(maxX / searchRadius) + 1;
+        gridRows = int(maxY / searchRadius) + 1;
+        for(auto& cell : grid)
+            cell.clear();
+        grid.resize(gridCols * gridRows);
+        for(size_t k=0; k<keypts.size(); k++)
+            grid[Cell(keypts[k].pt.y) * gridCols + Cell(keypts[k].pt.x)].push_back(int(k));
+    }
+
+    int Cell(float coord) const
+    {
+        return std::max(0, int(coord / searchRadius));
+    }
+
+    template<typename Visit>
+    void ForNeighbours(const std::vector<cv::KeyPoint>& keypts, cv::Point2f center, Visit visit) const
+    {
+        const int cx = Cell(center.x), cy = Cell(center.y);
+        for(int y=std::max(0, cy-1); y<=std::min(gridRows-1, cy+1); y++)
+            for(int x=std::max(0, cx-1); x<=std::min(gridCols-1, cx+1); x++)
+                for(int k : grid[y * gridCols + x])
+                {
+                    const cv::Point2f d = keypts[k].pt - center;
+                    if(d.x * d.x + d.y * d.y <= searchRadius * searchRadius)
+                        visit(k);
+                }
+    }
+
+    static float Distance(const cv::Mat& a, const cv::Mat& b)
+    {
+        return float(cv::norm(a, b, a.type() == CV_8U ? cv::NORM_HAMMING : cv::NORM_L2));
+    }
+};
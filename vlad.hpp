@@ -0,0 +1,279 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+
+// VladEncoder aggregates the local descriptors of one image into a single
+// vector: the residuals to their nearest vocabulary word, summed per word,
+// signed square rooted and L2 normalized
+class VladEncoder
+{
+    cv::Mat centers;        // words x descriptor size, float
+
+public:
+    // binary descriptors are unpacked to one 0/1 float per bit
+    static cv::Mat ToFloat(const cv::Mat& desc)
+    {
+        cv::Mat out;
+        if(desc.type() != CV_8U)
+        {
+            desc.convertTo(out, CV_32F);
+            return out;
+        }
+        out.create(desc.rows, desc.cols * 8, CV_32F);
+        for(int r=0; r<desc.rows; r++)
+        {
+            const uchar* in = desc.ptr<uchar>(r);
+            float* bits = out.ptr<float>(r);
+            for(int c=0; c<desc.cols * 8; c++)
+                bits[c] = float((in[c >> 3] >> (c & 7)) & 1);
+        }
+        return out;
+    }
+
+    // vocabulary from (float) descriptors of training images
+    void Train(const cv::Mat& samples, int words=64)
+    {
+        cv::Mat labels;
+        cv::kmeans(samples, std::min(words, samples.rows), labels,
+                   cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 20, 1e-3),
+                   2, cv::KMEANS_PP_CENTERS, centers);
+    }
+
+    bool Trained() const { return !centers.empty(); }
+    int Dims() const { return centers.rows * centers.cols; }
+
+    cv::Mat Encode(const cv::Mat& desc) const
+    {
+        const cv::Mat samples = ToFloat(desc);
+        const int d = centers.cols;
+        cv::Mat vlad = cv::Mat::zeros(1, Dims(), CV_32F);
+        float* v = vlad.ptr<float>();
+        for(int r=0; r<samples.rows; r++)
+        {
+            const float* x = samples.ptr<float>(r);
+            int best = 0;
+            float bestDist = FLT_MAX;
+            for(int w=0; w<centers.rows; w++)
+            {
+                const float* c = centers.ptr<float>(w);
+                float dist = 0;
+                for(int j=0; j<d; j++)
+                    dist += (x[j] - c[j]) * (x[j] - c[j]);
+                if(dist < bestDist)
+                {
+                    bestDist = dist;
+                    best = w;
+                }
+            }
+            const float* c = centers.ptr<float>(best);
+            for(int j=0; j<d; j++)
+                v[best * d + j] += x[j] - c[j];
+        }
+        for(int j=0; j<vlad.cols; j++)
+            v[j] = v[j] >= 0 ? std::sqrt(v[j]) : -std::sqrt(-v[j]);
+        cv::normalize(vlad, vlad);
+        return vlad;
+    }
+};
+
+
+// ProductQuantizer splits a vector into m sub-vectors and stores each as
+// the index of its nearest of up to 256 sub-centroids, one byte per
+// sub-vector. Distances to a query are looked up from a per-query table
+// (asymmetric distance computation) without decoding anything
+class ProductQuantizer
+{
+    int m;
+    int sub;
+    std::vector<cv::Mat> codebooks;     // m x (centroids x sub)
+
+public:
+    ProductQuantizer(int _m=16) : m(_m), sub(0) {}
+
+    int CodeSize() const { return m; }
+
+    void Train(const cv::Mat& samples)
+    {
+        if(samples.cols == 0)
+            throw std::string("no dimensions to quantize");
+        // one dimension per sub-vector at most
+        m = std::min(m, samples.cols);
+        sub = samples.cols / m;
+        codebooks.assign(m, cv::Mat());
+        for(int j=0; j<m; j++)
+        {
+            cv::Mat part = samples.colRange(j * sub, (j + 1) * sub).clone();
+            cv::Mat labels;
+            cv::kmeans(part, std::min(256, part.rows), labels,
+                       cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 25, 1e-4),
+                       1, cv::KMEANS_PP_CENTERS, codebooks[j]);
+        }
+    }
+
+    void Encode(const cv::Mat& vec, uint8_t* code) const
+    {
+        const float* x = vec.ptr<float>();
+        for(int j=0; j<m; j++)
+        {
+            float bestDist = FLT_MAX;
+            for(int c=0; c<codebooks[j].rows; c++)
+            {
+                const float dist = SubDistance(x + j * sub, codebooks[j].ptr<float>(c));
+                if(dist < bestDist)
+                {
+                    bestDist = dist;
+                    code[j] = uint8_t(c);
+                }
+            }
+        }
+    }
+
+    // m x 256 squared distances from the query's sub-vectors to every sub-centroid
+    std::vector<float> DistanceTable(const cv::Mat& query) const
+    {
+        const float* x = query.ptr<float>();
+        std::vector<float> table(m * 256, FLT_MAX);
+        for(int j=0; j<m; j++)
+            for(int c=0; c<codebooks[j].rows; c++)
+                table[j * 256 + c] = SubDistance(x + j * sub, codebooks[j].ptr<float>(c));
+        return table;
+    }
+
+    float Distance(const std::vector<float>& table, const uint8_t* code) const
+    {
+        float dist = 0;
+        for(int j=0; j<m; j++)
+            dist += table[j * 256 + code[j]];
+        return dist;
+    }
+
+private:
+    float SubDistance(const float* a, const float* b) const
+    {
+        float dist = 0;
+        for(int i=0; i<sub; i++)
+            dist += (a[i] - b[i]) * (a[i] - b[i]);
+        return dist;
+    }
+};
+
+
+// GlobalIndex retrieves the references whose whole-image appearance is
+// closest to a query, as a cheap filter before local feature matching.
+// images are VLAD encoded, PCA whitened to a few hundred dimensions and
+// product quantized, so a reference costs CodeSize() bytes and a query
+// scans all codes with table lookups only
+class GlobalIndex
+{
+    VladEncoder vlad;
+    cv::PCA pca;
+    cv::Mat whitening;      // 1 / sqrt(eigenvalue) per component
+    ProductQuantizer pq;
+    std::vector<uint8_t> codes;
+    std::vector<int> ids;
+
+public:
+    struct Candidate
+    {
+        int id;
+        float distance;
+    };
+
+    GlobalIndex(int codeSize=16) : pq(codeSize) {}
+
+    // vocabulary, PCA and PQ codebooks from the descriptors of training
+    // images; at most maxImages of them, evenly spaced, are used, so the
+    // references themselves can be passed however many there are.
+    // the vocabulary is clustered from at most maxSamples descriptors
+    // PCA keeps fewer than dims components if there are few training images
+    void Train(const std::vector<cv::Mat>& images, int words=64, int dims=256, int maxImages=5000,
+               int maxSamples=100000)
+    {
+        std::vector<cv::Mat> training;
+        const size_t step = std::max<size_t>(1, (images.size() + maxImages - 1) / maxImages);
+        for(size_t i=0; i<images.size(); i+=step)
+            if(!images[i].empty())
+                training.push_back(images[i]);
+        if(training.size() < 2)
+            throw std::string("global index training needs at least two images with features");
+
+        // every image contributes its share of maxSamples random rows, which
+        // are converted one at a time, so at most maxSamples rows are held
+        cv::Mat samples;
+        cv::RNG rng(12345);
+        std::vector<int> order;
+        const size_t n = training.size();
+        for(size_t i=0; i<n; i++)
+        {
+            const cv::Mat& desc = training[i];
+            const int quota = int(uint64_t(maxSamples) * (i + 1) / n - uint64_t(maxSamples) * i / n);
+            const int take = std::min(quota, desc.rows);
+            order.resize(desc.rows);
+            for(int r=0; r<desc.rows; r++)
+                order[r] = r;
+            for(int r=0; r<take; r++)
+            {
+                std::swap(order[r], order[r + rng.uniform(0, desc.rows - r)]);
+                samples.push_back(VladEncoder::ToFloat(desc.row(order[r])));
+            }
+        }
+        vlad.Train(samples, words);
+
+        cv::Mat vlads;
+        for(const cv::Mat& desc : training)
+            vlads.push_back(vlad.Encode(desc));
+        pca = cv::PCA(vlads, cv::noArray(), cv::PCA::DATA_AS_ROW, std::min(dims, vlads.rows - 1));
+        whitening.create(1, pca.eigenvalues.rows, CV_32F);
+        for(int i=0; i<whitening.cols; i++)
+            whitening.at<float>(i) = 1.f / std::sqrt(pca.eigenvalues.at<float>(i) + 1e-6f);
+
+        cv::Mat reduced;
+        for(int i=0; i<vlads.rows; i++)
+            reduced.push_back(Reduce(vlads.row(i)));
+        pq.Train(reduced);
+    }
+
+    bool Trained() const { return vlad.Trained(); }
+    size_t Size() const { return ids.size(); }
+
+    void Add(int id, const cv::Mat& desc)
+    {
+        codes.resize(codes.size() + pq.CodeSize());
+        pq.Encode(Describe(desc), &codes[codes.size() - pq.CodeSize()]);
+        ids.push_back(id);
+    }
+
+    // the topK nearest references, closest first
+    std::vector<Candidate> Search(const cv::Mat& desc, int topK) const
+    {
+        const std::vector<float> table = pq.DistanceTable(Describe(desc));
+        std::vector<Candidate> candidates(ids.size());
+        for(size_t i=0; i<ids.size(); i++)
+            candidates[i] = {ids[i], pq.Distance(table, &codes[i * pq.CodeSize()])};
+
+        auto closer = [](const Candidate& a, const Candidate& b) { return a.distance < b.distance; };
+        const size_t k = std::min(candidates.size(), size_t(std::max(topK, 0)));
+        std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(), closer);
+        candidates.resize(k);
+        return candidates;
+    }
+
+    // whitened, normalized global descriptor of an image's local descriptors
+    cv::Mat Describe(const cv::Mat& desc) const
+    {
+        return Reduce(vlad.Encode(desc));
+    }
+
+private:
+    cv::Mat Reduce(const cv::Mat& vec) const
+    {
+        cv::Mat reduced = pca.project(vec).mul(whitening);
+        cv::normalize(reduced, reduced);
+        return reduced;
+    }
+};